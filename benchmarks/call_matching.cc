@@ -0,0 +1,75 @@
+/// Copyright (c) 2023 Samir Bioud
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+/// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+/// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+/// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+/// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+/// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+/// OR OTHER DEALINGS IN THE SOFTWARE.
+///
+
+
+///
+/// Measures the cost of following a call edge in matches()
+///
+/// compares a machine which calls a shared sub-machine against the same machine with the sub-machine
+/// inlined. The call is unambiguous, so both should run at a similar (constant) cost per byte
+///
+
+#include "regex-backend/state_machine.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using namespace regex_backend;
+using Regex = StateMachine<void, char>;
+
+int main() {
+  constexpr size_t BODY_SIZE = 1 << 20;
+  constexpr size_t ROUNDS    = 16;
+
+  Regex letter;
+  letter.match_alpha().exit_point();
+
+  // large enough to be called rather than inlined by match_call()
+  auto comment = std::make_shared<Regex>();
+  comment->match_sequence("/*");
+  for (size_t i = 0; i < Regex::CALL_INLINE_NODES; i++) {
+    comment->match_sequence("x");
+  }
+  comment->match_many(letter).match_sequence("*/").exit_point();
+
+  Regex called;
+  called.match_sequence("<").match_call(comment).match_sequence(">").exit_point();
+  Regex inlined;
+  inlined.match_sequence("<").match(*comment).match_sequence(">").exit_point();
+
+  std::string input = "</*" + std::string(Regex::CALL_INLINE_NODES, 'x') + std::string(BODY_SIZE, 'q') + "*/>";
+  std::span<char> data(input.data(), input.size());
+
+  std::cout << "machine     ns/byte\n";
+  for (auto [name, machine] : {std::pair{"inlined", &inlined}, std::pair{"called", &called}}) {
+    bool matched     = true;
+    auto const start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < ROUNDS; r++) {
+      matched &= bool(machine->matches(data));
+    }
+    std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << std::left << std::setw(9) << name << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+              << elapsed.count() / double(ROUNDS * input.size()) << (matched ? "" : " (no match)") << "\n";
+  }
+}
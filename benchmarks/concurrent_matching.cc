@@ -0,0 +1,118 @@
+/// Copyright (c) 2023 Samir Bioud
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+/// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+/// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+/// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+/// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+/// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+/// OR OTHER DEALINGS IN THE SOFTWARE.
+///
+
+///
+/// Measures scan throughput of a single machine shared between 1 -> N threads
+///
+/// each thread scans the same (shared) input, so with a const, lock-free lookup path
+/// aggregate throughput should scale linearly with the number of threads
+///
+/// both the compiled machine and the machine it was compiled from are measured, the latter
+/// scanning as a stream of find() calls
+///
+
+#include "regex-backend/state_machine.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace regex_backend;
+
+int main(int argc, char** argv) {
+  size_t const max_threads = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+  constexpr size_t INPUT_SIZE = 8 * 1024 * 1024;
+  constexpr size_t ROUNDS     = 4;
+
+  std::mt19937 rng(42);
+  auto const random_word = [&](size_t len) {
+    std::string w;
+    for (size_t i = 0; i < len; i++) {
+      w += 'a' + rng() % 26;
+    }
+    return w;
+  };
+
+  std::vector<std::string> words;
+  StateMachine<void, char> machine;
+  for (size_t i = 0; i < 64; i++) {
+    words.push_back(random_word(4 + rng() % 6));
+    machine.match_sequence(words.back()).exit_point().root();
+  }
+  machine.optimize();
+  auto const compiled = machine.compile();
+
+  std::string input;
+  while (input.size() < INPUT_SIZE) {
+    input += rng() % 8 ? random_word(1 + rng() % 10) : words[rng() % words.size()];
+    input += ' ';
+  }
+  std::span<char> data(input.data(), input.size());
+
+  auto const measure = [&](char const* name, size_t rounds, auto const& scan) {
+    double single_thread_rate = 0;
+    std::cout << name << "\nthreads    MB/s     scaling\n";
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      std::vector<std::thread> pool;
+      std::vector<size_t> matched(threads, 0);
+
+      auto const start = std::chrono::steady_clock::now();
+      for (size_t t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+          for (size_t r = 0; r < rounds; r++) {
+            matched[t] += scan();
+          }
+        });
+      }
+      for (auto& th : pool) {
+        th.join();
+      }
+      std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+
+      double const rate = double(INPUT_SIZE * rounds * threads) / (1024 * 1024) / elapsed.count();
+      if (threads == 1) {
+        single_thread_rate = rate;
+      }
+      std::cout << std::setw(7) << threads << std::setw(9) << std::fixed << std::setprecision(1) << rate
+                << std::setw(11) << std::setprecision(2) << rate / single_thread_rate << "x\n";
+    }
+  };
+
+  measure("compiled scan()", ROUNDS, [&] { return compiled.scan(data, [](auto const&) {}); });
+
+  // each find() is anchored, so the scan tries every position which is not inside an earlier match
+  measure("uncompiled find()", 1, [&] {
+    size_t matches = 0;
+    for (size_t pos = 0; pos < data.size();) {
+      auto const found = machine.find(data.subspan(pos));
+      if (found.range.empty()) {
+        pos++;
+        continue;
+      }
+      matches++;
+      pos = found.range.data() + found.range.size() - data.data();
+    }
+    return matches;
+  });
+}
@@ -0,0 +1,88 @@
+/// Copyright (c) 2023 Samir Bioud
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+/// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+/// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+/// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+/// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+/// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+/// OR OTHER DEALINGS IN THE SOFTWARE.
+///
+
+///
+/// Measures the per-lookup overhead of reading through a MachineHandle
+///
+/// compares matching through a plain reference against matching through handle.read(),
+/// both with and without a writer concurrently publishing new machines
+///
+
+#include "regex-backend/machine_handle.h"
+#include "regex-backend/state_machine.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace regex_backend;
+
+using Compiled = decltype(std::declval<StateMachine<void, char>>().compile());
+
+static Compiled make_machine(size_t version) {
+  StateMachine<void, char> machine;
+  machine.match_sequence("version" + std::to_string(version)).exit_point().optimize();
+  return machine.compile();
+}
+
+template <typename Fn> static double ns_per_op(size_t iterations, Fn&& fn) {
+  auto const start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++) {
+    fn();
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+int main() {
+  constexpr size_t ITERATIONS = 20'000'000;
+
+  std::string input = "version0";
+  auto span         = std::span<char>(input.data(), input.size());
+  size_t hits       = 0;
+
+  auto const direct_machine = make_machine(0);
+  MachineHandle<Compiled> handle(make_machine(0));
+
+  auto const direct = ns_per_op(ITERATIONS, [&] { hits += (bool)direct_machine.matches(span); });
+  auto const quiet  = ns_per_op(ITERATIONS, [&] { hits += (bool)handle.read()->matches(span); });
+
+  std::atomic<bool> done  = false;
+  size_t publishes        = 0;
+  std::thread writer([&] {
+    while (!done) {
+      handle.publish(make_machine(++publishes % 2));
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+  auto const contended = ns_per_op(ITERATIONS, [&] { hits += (bool)handle.read()->matches(span); });
+  done                 = true;
+  writer.join();
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "direct:            " << direct << " ns/op\n";
+  std::cout << "handle:            " << quiet << " ns/op (+" << quiet - direct << ")\n";
+  std::cout << "handle + publish:  " << contended << " ns/op (+" << contended - direct << ", " << publishes
+            << " publishes)\n";
+  std::cout << "(" << hits << " hits)\n";
+}
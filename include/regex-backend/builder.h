@@ -59,7 +59,7 @@ private:
   template <typename T> struct _M_source_range_t {
     char const* begin;
     char const* end;
-    Value_T* value;
+    Value_T const* value;
   };
 
   template <> struct _M_source_range_t<void> {
@@ -68,7 +68,7 @@ private:
   };
 
   template <typename T> struct _M_MatchResult_T {
-    using type = Value_T*;
+    using type = Value_T const*;
   };
 
   template <> struct _M_MatchResult_T<void> {
@@ -77,7 +77,7 @@ private:
 
   template <typename T> struct _M_LookupResult {
     char const* end;
-    Value_T* value;
+    Value_T const* value;
   };
 
   template <> struct _M_LookupResult<void> {
@@ -99,22 +99,60 @@ private:
     return _m_nodes[number - 1];
   }
 
+  Node_T const& get_node(size_t number) const {
+    MUTILS_ASSERT_NEQ(number, 0, "Attempt to load a null transition");
+    MUTILS_ASSERT_LTE(number, _m_nodes.size(), "Attempt to access an out-of-range node");
+    return _m_nodes[number - 1];
+  }
+
 public:
   MutableStateMachine() {
     // root node insertion
     _m_nodes.push_back(Node_T());
   }
 
+  ///
+  /// Two machines are equal when their reachable nodes correspond one to one
+  ///
+  /// nodes are matched up breadth-first from the root, so the order in which
+  /// either machine created its nodes does not matter
+  ///
   bool operator==(MutableStateMachine const& other) const {
-
-    if (_m_nodes.size() != other._m_nodes.size()) {
-      return false;
-    }
-
-    for (size_t i = 0; i < _m_nodes.size(); i++) {
-      if (_m_nodes[i] != other._m_nodes[i]) {
+    std::vector<size_t> to_other(_m_nodes.size(), 0);
+    std::vector<size_t> from_other(other._m_nodes.size(), 0);
+    std::vector<size_t> queue = {1};
+    to_other[0]               = 1;
+    from_other[0]             = 1;
+
+    for (size_t i = 0; i < queue.size(); i++) {
+      auto const& node       = get_node(queue[i]);
+      auto const& other_node = other.get_node(to_other[queue[i] - 1]);
+      if (node.can_exit() != other_node.can_exit() || node.consume_char != other_node.consume_char) {
         return false;
       }
+      if constexpr (!std::is_void_v<Value_T>) {
+        if (node.value != other_node.value) {
+          return false;
+        }
+      }
+
+      for (size_t c = 0; c < node.transitions.size(); c++) {
+        auto const to       = node.transitions[c];
+        auto const other_to = other_node.transitions[c];
+        if ((to == 0) != (other_to == 0)) {
+          return false;
+        }
+        if (to == 0) {
+          continue;
+        }
+        if (!to_other[to - 1] && !from_other[other_to - 1]) {
+          to_other[to - 1]         = other_to;
+          from_other[other_to - 1] = to;
+          queue.push_back(to);
+        } else if (to_other[to - 1] != other_to || from_other[other_to - 1] != to) {
+          return false;
+        }
+      }
     }
     return true;
   }
@@ -553,6 +591,9 @@ public:
   // Lookup-oriented functions
   // performance matters
   //
+  // none of these functions modify the machine, they may be called concurrently
+  // from any number of threads, as long as the machine is not being built at the same time
+  //
 
   using matchresult = typename _M_MatchResult_T<Value_T>::type;
 
@@ -560,7 +601,7 @@ public:
    * Test if the state machine successfully matches
    * the entire string
    */
-  template <bool FILEMODE = false> matchresult matches(const std::string_view s) {
+  template <bool FILEMODE = false> matchresult matches(const std::string_view s) const {
     size_t node = 1;
 
     if constexpr (FILEMODE) {
@@ -612,12 +653,12 @@ public:
    *
    * end will be nullptr if the match fails
    */
-  lookup_result lookup(char const* s) {
+  lookup_result lookup(char const* s) const {
     char const* c = s;
     size_t n      = 1;
 
-    char const* last_val    = nullptr;
-    Node_T* last_value_node = nullptr;
+    char const* last_val          = nullptr;
+    Node_T const* last_value_node = nullptr;
 
     while (*c != 0) {
       auto idx = get_node(n).transitions[*c];
@@ -625,7 +666,7 @@ public:
       if (idx == 0) {
         break;
       }
-      Node_T& next = get_node(idx);
+      Node_T const& next = get_node(idx);
 
       if (next.can_exit()) {
         last_val        = c;
@@ -660,7 +701,7 @@ public:
    *
    * NOTE: This function can be quite slow ( O(n^2) ), so please consider alternative methods before using this
    */
-  source_range find_first(char const* s) {
+  source_range find_first(char const* s) const {
     //
     // We consider a match to have occurred if the substring
     // causes a traversal through a value-node at any point
@@ -673,9 +714,9 @@ public:
     char const* ss = s;
 
     while (*ss != 0) {
-      size_t node                = 1;
-      Node_T* last_value_node    = nullptr;
-      char const* last_value_ptr = nullptr;
+      size_t node                   = 1;
+      Node_T const* last_value_node = nullptr;
+      char const* last_value_ptr    = nullptr;
       for (auto c = ss; *c != 0; c++) {
         auto next = get_node(node).transitions[*c];
 
@@ -723,7 +764,7 @@ public:
    * NOTE: This function can be quite slow, so please consider alternative methods before using this
    */
 
-  std::vector<source_range> find_many(char const* s) {
+  std::vector<source_range> find_many(char const* s) const {
     std::vector<source_range> return_value;
 
     char const* cur = s;
@@ -0,0 +1,114 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./state_machine.h"
+#include "./util/thread_pool.h"
+#include "mutils/assert.h"
+#include <span>
+#include <vector>
+
+///
+/// Parallel matching of many independent inputs against a single machine
+///
+/// works with any machine exposing the const lookup api (StateMachine or CompiledStateMachine)
+///
+namespace regex_backend {
+
+using WorkStealingPool = internal::WorkStealingPool;
+
+namespace internal {
+
+///
+/// Split the inputs into contiguous batches of roughly BATCH_BYTES each,
+/// so that a few very large inputs do not end up starving the rest of the pool
+///
+template <typename Input_T> std::vector<WorkStealingPool::Batch> batch_inputs(std::span<Input_T const> inputs) {
+  constexpr size_t BATCH_BYTES = 64 * 1024;
+  constexpr size_t BATCH_COUNT = 4096;
+
+  std::vector<WorkStealingPool::Batch> batches;
+  size_t begin = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    bytes += inputs[i].size_bytes();
+    if (bytes >= BATCH_BYTES || i + 1 - begin >= BATCH_COUNT) {
+      batches.push_back({begin, i + 1});
+      begin = i + 1;
+      bytes = 0;
+    }
+  }
+  if (begin != inputs.size()) {
+    batches.push_back({begin, inputs.size()});
+  }
+  return batches;
+}
+}; // namespace internal
+
+///
+/// Run machine.matches() over every input on the pool
+/// the result for inputs[i] is written to results[i]
+///
+template <bool const INCLUDE_EOF = false, typename Machine_T>
+void matches_many(Machine_T const& machine,
+                  std::span<std::span<typename Machine_T::input_t> const> inputs,
+                  std::span<typename Machine_T::match_result> results,
+                  WorkStealingPool& pool) {
+  MUTILS_ASSERT_EQ(inputs.size(), results.size(), "Every input requires a result slot");
+
+  pool.run(internal::batch_inputs(inputs), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      results[i] = machine.template matches<INCLUDE_EOF>(inputs[i]);
+    }
+  });
+}
+
+///
+/// Find every match within each of the inputs on the pool
+/// the matches made within inputs[i] are appended to results[i], in order
+///
+/// scanning an input stops at the first error or empty match (which are not included)
+///
+template <typename Machine_T>
+void find_many_documents(Machine_T const& machine,
+                         std::span<std::span<typename Machine_T::input_t> const> inputs,
+                         std::span<std::vector<typename Machine_T::find_result>> results,
+                         WorkStealingPool& pool) {
+  MUTILS_ASSERT_EQ(inputs.size(), results.size(), "Every input requires a result slot");
+
+  pool.run(internal::batch_inputs(inputs), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      auto data = inputs[i];
+      while (data.size()) {
+        auto result = machine.find(data);
+        if (result.range.size() == 0) {
+          break;
+        }
+        results[i].push_back(result);
+        data = data.subspan(result.range.end() - data.begin());
+      }
+    }
+  });
+}
+
+}; // namespace regex_backend
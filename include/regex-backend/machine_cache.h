@@ -0,0 +1,158 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace regex_backend {
+
+///
+/// A concurrent cache of immutable machines, keyed by whatever they were built from
+/// (i.e the configuration string a set of patterns was read from)
+///
+/// every request for a key returns the same shared instance, and concurrent requests for a key
+/// which is still being built wait for that one build rather than starting their own.
+/// The least recently requested machines are evicted once the cache holds more than 'capacity'
+/// of them, an evicted machine lives on for as long as anything still holds it
+///
+template <typename Machine_T, typename Key_T = std::string> class MachineCache {
+public:
+  using Ptr_T = std::shared_ptr<Machine_T const>;
+
+  struct Stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+  };
+
+private:
+  struct Entry {
+    Key_T key;
+    std::shared_future<Ptr_T> machine;
+    size_t build; // tells this build's entry apart from a later one for the same key
+  };
+
+  // most recently requested first
+  std::list<Entry> m_lru;
+  std::unordered_map<Key_T, typename std::list<Entry>::iterator> m_entries;
+  size_t m_capacity;
+  size_t m_builds = 0;
+  mutable std::mutex m_lock;
+
+  std::atomic<size_t> m_hits      = 0;
+  std::atomic<size_t> m_misses    = 0;
+  std::atomic<size_t> m_evictions = 0;
+
+public:
+  explicit MachineCache(size_t capacity) : m_capacity(capacity) {
+  }
+
+  MachineCache(MachineCache const&)            = delete;
+  MachineCache& operator=(MachineCache const&) = delete;
+
+  ///
+  /// The process-wide cache for this machine type
+  ///
+  static MachineCache& shared() {
+    static MachineCache cache(256);
+    return cache;
+  }
+
+  ///
+  /// Get the machine cached under 'key', building it with 'build()' if there is none
+  ///
+  /// the build runs on the calling thread, outside of the cache lock. If it throws, the exception is
+  /// rethrown to every request waiting on that build, and the key is dropped so the next request builds again
+  ///
+  template <typename Build_T> Ptr_T get(Key_T const& key, Build_T&& build) {
+    std::promise<Ptr_T> built;
+    std::unique_lock lk(m_lock);
+
+    auto const existing = m_entries.find(key);
+    if (existing != m_entries.end()) {
+      m_lru.splice(m_lru.begin(), m_lru, existing->second);
+      auto machine = existing->second->machine;
+      lk.unlock();
+
+      m_hits.fetch_add(1, std::memory_order_relaxed);
+      return machine.get();
+    }
+
+    auto const build_id = m_builds++;
+    m_lru.push_front(Entry{key, built.get_future().share(), build_id});
+    m_entries[key] = m_lru.begin();
+    while (m_lru.size() > m_capacity) {
+      m_entries.erase(m_lru.back().key);
+      m_lru.pop_back();
+      m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    lk.unlock();
+
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    Ptr_T machine;
+    try {
+      machine = std::make_shared<Machine_T const>(build());
+    } catch (...) {
+      built.set_exception(std::current_exception());
+      lk.lock();
+      auto const failed = m_entries.find(key);
+      if (failed != m_entries.end() && failed->second->build == build_id) {
+        m_lru.erase(failed->second);
+        m_entries.erase(failed);
+      }
+      throw;
+    }
+    built.set_value(machine);
+    return machine;
+  }
+
+  ///
+  /// Drop every cached machine
+  ///
+  void clear() {
+    std::lock_guard lk(m_lock);
+    m_entries.clear();
+    m_lru.clear();
+  }
+
+  size_t size() const {
+    std::lock_guard lk(m_lock);
+    return m_lru.size();
+  }
+
+  Stats stats() const {
+    return {m_hits.load(), m_misses.load(), m_evictions.load()};
+  }
+};
+
+}; // namespace regex_backend
@@ -0,0 +1,253 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./util/barrier.h"
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace regex_backend {
+
+namespace internal {
+
+///
+/// Leases reader slot indices to threads, an index is held by at most one live thread at a time
+///
+/// a thread takes the lowest free index the first time it reads any MachineHandle, and gives it back when
+/// it exits. Once every index is held, further threads get NONE
+///
+class ReaderSlotLease {
+  std::atomic<uint64_t>& taken() {
+    static std::atomic<uint64_t> bits = 0;
+    return bits;
+  }
+
+public:
+  constexpr static size_t COUNT = 64;
+  constexpr static size_t NONE  = COUNT;
+
+  size_t const index;
+
+  ReaderSlotLease() : index(claim()) {
+  }
+
+  ~ReaderSlotLease() {
+    if (index != NONE) {
+      taken().fetch_and(~(uint64_t(1) << index), std::memory_order_release);
+    }
+  }
+
+  ///
+  /// The index leased to the calling thread
+  ///
+  static size_t local() {
+    thread_local ReaderSlotLease lease;
+    return lease.index;
+  }
+
+private:
+  size_t claim() {
+    auto bits = taken().load(std::memory_order_relaxed);
+    while (~bits) {
+      auto const free = static_cast<size_t>(std::countr_one(bits));
+      if (taken().compare_exchange_weak(bits, bits | (uint64_t(1) << free), std::memory_order_acquire)) {
+        return free;
+      }
+    }
+    return NONE;
+  }
+};
+
+}; // namespace internal
+
+///
+/// A shared reference to a machine which can be atomically replaced while other threads are reading it
+///
+/// Readers never block: read() announces the epoch it read under in a slot owned by the calling thread
+/// (a relaxed store and a light barrier, see light_barrier(), with no read-modify-write), and the returned
+/// guard keeps the machine alive until it is destroyed. publish() swaps in a new machine, advances the epoch and waits for every
+/// reader which announced an earlier epoch to finish before reclaiming the old machine, so only the
+/// publishing thread ever waits. Threads beyond the first 64 concurrent readers fall back to counting
+/// themselves in a shared slot, which costs two read-modify-writes per read
+///
+/// Note: a thread must not publish() while it holds a reader guard of the same handle, and a reader guard
+/// must be destroyed by the thread which took it
+///
+template <typename Machine_T> class MachineHandle {
+  constexpr static size_t SLOT_COUNT = internal::ReaderSlotLease::COUNT;
+  constexpr static size_t IDLE       = std::numeric_limits<size_t>::max();
+
+  // every thread reads through the slot it leased, see ReaderSlotLease
+  struct alignas(64) Slot {
+    std::atomic<size_t> announced = IDLE; // the epoch the thread's outermost reader read under
+    size_t depth                  = 0;    // the thread's live readers, only touched by that thread
+  };
+
+  // readers without a slot of their own are counted per epoch parity
+  struct alignas(64) Overflow {
+    std::atomic<size_t> readers[2] = {0, 0};
+  };
+
+  std::atomic<Machine_T const*> m_current;
+  std::atomic<size_t> m_epoch = 0;
+  std::unique_ptr<Slot[]> m_slots;
+  mutable Overflow m_overflow;
+  std::mutex m_writer_lock;
+
+public:
+  ///
+  /// Keeps the machine it refers to alive for as long as it exists
+  ///
+  class Reader {
+    MachineHandle const* m_handle;
+    Slot* m_slot; // null for readers counted in the overflow slot
+    size_t m_parity;
+    Machine_T const* m_machine;
+
+    friend class MachineHandle;
+
+    Reader(MachineHandle const* handle, Slot* slot, size_t parity, Machine_T const* machine) :
+        m_handle(handle), m_slot(slot), m_parity(parity), m_machine(machine) {
+    }
+
+  public:
+    Reader(Reader&& other) : m_handle(std::exchange(other.m_handle, nullptr)), m_slot(other.m_slot),
+                             m_parity(other.m_parity), m_machine(other.m_machine) {
+    }
+
+    Reader(Reader const&)            = delete;
+    Reader& operator=(Reader const&) = delete;
+
+    ~Reader() {
+      if (m_handle) {
+        m_handle->release(m_slot, m_parity);
+      }
+    }
+
+    Machine_T const& operator*() const {
+      return *m_machine;
+    }
+
+    Machine_T const* operator->() const {
+      return m_machine;
+    }
+  };
+
+  explicit MachineHandle(Machine_T machine) :
+      m_current(new Machine_T(std::move(machine))), m_slots(new Slot[SLOT_COUNT]) {
+  }
+
+  MachineHandle(MachineHandle const&)            = delete;
+  MachineHandle& operator=(MachineHandle const&) = delete;
+
+  ///
+  /// Note: every reader must have finished before the handle is destroyed
+  ///
+  ~MachineHandle() {
+    delete m_current.load();
+  }
+
+  ///
+  /// Get the current machine
+  ///
+  Reader read() const {
+    auto const index = internal::ReaderSlotLease::local();
+    if (index == internal::ReaderSlotLease::NONE) {
+      return read_overflow();
+    }
+
+    auto& slot = m_slots[index];
+    if (slot.depth++ == 0) {
+      while (true) {
+        auto const epoch = m_epoch.load(std::memory_order_relaxed);
+        slot.announced.store(epoch, std::memory_order_relaxed);
+        // pairs with the heavy barrier in publish(): either it sees our announcement, or we see its new epoch
+        internal::light_barrier();
+        if (m_epoch.load(std::memory_order_acquire) == epoch) {
+          break;
+        }
+      }
+    }
+    // nested readers share the outermost announcement, which is never later than the machine they read
+    return Reader(this, &slot, 0, m_current.load(std::memory_order_acquire));
+  }
+
+  ///
+  /// Atomically replace the current machine
+  ///
+  /// blocks until every reader of the previous machine has finished, then destroys it
+  ///
+  void publish(Machine_T machine) {
+    auto const next = new Machine_T(std::move(machine));
+
+    std::lock_guard lk(m_writer_lock);
+    auto const old   = m_current.exchange(next);
+    auto const epoch = m_epoch.fetch_add(1);
+    internal::heavy_barrier();
+
+    // readers announcing from now on see the new machine, so this can only drain
+    for (size_t i = 0; i < SLOT_COUNT; i++) {
+      while (m_slots[i].announced.load(std::memory_order_acquire) <= epoch) {
+        std::this_thread::yield();
+      }
+    }
+    while (m_overflow.readers[epoch & 1].load(std::memory_order_acquire) != 0) {
+      std::this_thread::yield();
+    }
+    delete old;
+  }
+
+private:
+  Reader read_overflow() const {
+    auto& overflow = m_overflow;
+    while (true) {
+      auto const epoch  = m_epoch.load();
+      auto const parity = epoch & 1;
+      overflow.readers[parity].fetch_add(1);
+
+      // if the epoch moved on while we were registering, the publisher may have already
+      // checked the counter, so we have to register again
+      if (m_epoch.load() == epoch) {
+        return Reader(this, nullptr, parity, m_current.load());
+      }
+      overflow.readers[parity].fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  void release(Slot* slot, size_t parity) const {
+    if (!slot) {
+      m_overflow.readers[parity].fetch_sub(1, std::memory_order_release);
+    } else if (--slot->depth == 0) {
+      slot->announced.store(IDLE, std::memory_order_release);
+    }
+  }
+};
+
+}; // namespace regex_backend
@@ -0,0 +1,232 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./util/hash.h"
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <type_traits>
+
+namespace regex_backend {
+
+///
+/// A bounded, thread-safe memo of matches() results, placed in front of a machine
+///
+/// inputs of up to MAX_KEY_BYTES are hashed into a 2-way set-associative table, so inputs which repeat
+/// heavily are answered without walking the machine. Longer inputs always go to the machine.
+/// Entries are versioned (a seqlock), so lookups never lock: a lookup which races a write simply misses
+///
+/// every thread tracks its own hit rate over windows of WINDOW lookups, and when a window hits less than
+/// a quarter of the time, that thread bypasses the table for its next BYPASS_LENGTH lookups, so inputs
+/// which rarely repeat do not pay for the hashing
+///
+/// Note: the machine must outlive the cache, cached results refer to its values
+///
+template <typename Machine_T, bool INCLUDE_EOF = false> class MatchCache {
+public:
+  using input_t      = typename Machine_T::input_t;
+  using match_result = typename Machine_T::match_result;
+
+  constexpr static size_t MAX_KEY_BYTES = 32;
+  constexpr static size_t WINDOW        = 1024;
+  constexpr static size_t BYPASS_LENGTH = 16 * WINDOW;
+
+  ///
+  /// Lookup counts, which are approximate when more threads than counter slots use the cache at once
+  ///
+  struct Stats {
+    size_t lookups;  // every call to matches()
+    size_t hits;     // answered from the table
+    size_t bypassed; // sent straight to the machine (too long, or bypassing)
+  };
+
+private:
+  static_assert(std::is_trivially_copyable_v<match_result>, "Match results must be trivially copyable to be cached");
+
+  constexpr static size_t KEY_WORDS    = MAX_KEY_BYTES / 8;
+  constexpr static size_t RESULT_WORDS = (sizeof(match_result) + 7) / 8;
+  constexpr static size_t THREAD_SLOTS = 16;
+
+  // every field is atomic, so readers racing a writer are well-defined (they discard what they read)
+  struct alignas(64) Entry {
+    std::atomic<uint64_t> version; // odd while the entry is being written
+    std::atomic<uint64_t> tag;     // the input hash, with its length + 1 in the low byte (0 when empty)
+    std::atomic<uint64_t> key[KEY_WORDS];
+    std::atomic<uint64_t> result[RESULT_WORDS];
+  };
+
+  // each thread owns a slot, so counting is a plain load and store rather than a locked increment
+  struct alignas(64) Counters {
+    std::atomic<size_t> lookups;
+    std::atomic<size_t> hits;
+    std::atomic<size_t> bypassed;
+    std::atomic<size_t> window_hits; // hits at the start of the current window
+    std::atomic<size_t> bypass;      // remaining lookups to bypass
+  };
+
+  Machine_T const& m_machine;
+  std::unique_ptr<Entry[]> m_entries;
+  size_t m_set_mask;
+  std::unique_ptr<Counters[]> m_counters;
+
+public:
+  explicit MatchCache(Machine_T const& machine, size_t capacity = 4096) :
+      m_machine(machine), m_counters(new Counters[THREAD_SLOTS]()) {
+    auto const sets = std::bit_ceil(std::max<size_t>(2, capacity) / 2);
+    m_entries.reset(new Entry[sets * 2]());
+    m_set_mask = sets - 1;
+  }
+
+  MatchCache(MatchCache const&)            = delete;
+  MatchCache& operator=(MatchCache const&) = delete;
+
+  ///
+  /// Equivalent to machine.matches<INCLUDE_EOF>(input)
+  ///
+  match_result matches(std::span<input_t> input) const {
+    auto& counters   = local_counters();
+    auto const bytes = input.size_bytes();
+    bump(counters.lookups);
+
+    auto bypass = counters.bypass.load(std::memory_order_relaxed);
+    if (bytes > MAX_KEY_BYTES || bypass) {
+      // threads sharing a slot may race for the last bypassed lookup, so the count never goes below 0
+      while (bytes <= MAX_KEY_BYTES && bypass &&
+             !counters.bypass.compare_exchange_weak(bypass, bypass - 1, std::memory_order_relaxed)) {
+      }
+      bump(counters.bypassed);
+      return m_machine.template matches<INCLUDE_EOF>(input);
+    }
+
+    uint64_t key[KEY_WORDS] = {};
+    if (input.data()) { // see hash_bytes()
+      std::memcpy(key, input.data(), bytes);
+    }
+    auto const hash = internal::hash_bytes(key, bytes);
+    auto const tag  = (hash & ~uint64_t(0xFF)) | (bytes + 1);
+    auto const set  = &m_entries[(hash & m_set_mask) * 2];
+
+    match_result result;
+    if (load(set[0], tag, key, result) || load(set[1], tag, key, result)) {
+      bump(counters.hits);
+      end_of_window(counters);
+      return result;
+    }
+
+    result = m_machine.template matches<INCLUDE_EOF>(input);
+
+    // fill an empty way if there is one, otherwise evict a way picked by the hash
+    auto const way = set[0].tag.load(std::memory_order_relaxed) == 0   ? 0
+                     : set[1].tag.load(std::memory_order_relaxed) == 0 ? 1
+                                                                       : (hash >> 32) & 1;
+    store(set[way], tag, key, result);
+    end_of_window(counters);
+    return result;
+  }
+
+  Stats stats() const {
+    Stats stats = {0, 0, 0};
+    for (size_t i = 0; i < THREAD_SLOTS; i++) {
+      stats.lookups += m_counters[i].lookups.load(std::memory_order_relaxed);
+      stats.hits += m_counters[i].hits.load(std::memory_order_relaxed);
+      stats.bypassed += m_counters[i].bypassed.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+private:
+  Counters& local_counters() const {
+    static std::atomic<size_t> next_slot = 0;
+    thread_local size_t slot             = next_slot.fetch_add(1, std::memory_order_relaxed) % THREAD_SLOTS;
+    return m_counters[slot];
+  }
+
+  static void bump(std::atomic<size_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  static void end_of_window(Counters& counters) {
+    auto const cached_lookups = counters.lookups.load(std::memory_order_relaxed) -
+                                counters.bypassed.load(std::memory_order_relaxed);
+    if (cached_lookups % WINDOW != 0) {
+      return;
+    }
+    auto const hits        = counters.hits.load(std::memory_order_relaxed);
+    auto const window_hits = hits - counters.window_hits.load(std::memory_order_relaxed);
+    counters.window_hits.store(hits, std::memory_order_relaxed);
+    // the first window is spent filling a cold table, so it says nothing about the hit rate
+    if (cached_lookups > WINDOW && window_hits * 4 < WINDOW) {
+      counters.bypass.store(BYPASS_LENGTH, std::memory_order_relaxed);
+    }
+  }
+
+  static bool load(Entry const& entry, uint64_t tag, uint64_t const* key, match_result& result) {
+    auto const version = entry.version.load(std::memory_order_acquire);
+    if ((version & 1) || entry.tag.load(std::memory_order_relaxed) != tag) {
+      return false;
+    }
+    for (size_t i = 0; i < KEY_WORDS; i++) {
+      if (entry.key[i].load(std::memory_order_relaxed) != key[i]) {
+        return false;
+      }
+    }
+    uint64_t words[RESULT_WORDS];
+    for (size_t i = 0; i < RESULT_WORDS; i++) {
+      words[i] = entry.result[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.version.load(std::memory_order_relaxed) != version) {
+      return false;
+    }
+    std::memcpy(&result, words, sizeof(match_result));
+    return true;
+  }
+
+  static void store(Entry& entry, uint64_t tag, uint64_t const* key, match_result const& result) {
+    auto version = entry.version.load(std::memory_order_relaxed);
+    if ((version & 1) || !entry.version.compare_exchange_strong(version, version + 1, std::memory_order_acquire)) {
+      // another thread is writing this entry, keeping either result is fine
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[RESULT_WORDS] = {};
+    std::memcpy(words, &result, sizeof(match_result));
+    entry.tag.store(tag, std::memory_order_relaxed);
+    for (size_t i = 0; i < KEY_WORDS; i++) {
+      entry.key[i].store(key[i], std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < RESULT_WORDS; i++) {
+      entry.result[i].store(words[i], std::memory_order_relaxed);
+    }
+    entry.version.store(version + 2, std::memory_order_release);
+  }
+};
+
+}; // namespace regex_backend
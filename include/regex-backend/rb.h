@@ -22,4 +22,9 @@
 #pragma once
 
 #include "./builder.h"
+#include "./bulk.h"
+#include "./machine_cache.h"
+#include "./machine_handle.h"
+#include "./match_cache.h"
 #include "./state_machine.h"
+#include "./tiered.h"
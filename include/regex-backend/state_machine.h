@@ -19,14 +19,47 @@
 // OR OTHER DEALINGS IN THE SOFTWARE.
 //
 
+#pragma once
+
+#include "./state_machine_internal/algebra.h"
+#include "./state_machine_internal/approximate.h"
 #include "./state_machine_internal/builder.h"
+#include "./state_machine_internal/compiled.h"
+#include "./state_machine_internal/dictionary.h"
+#include "./state_machine_internal/multi_scanner.h"
 #include "./state_machine_internal/node.h"
+#include "./state_machine_internal/partition.h"
 #include "./util/sets.h"
 #include <cstdint>
 
 namespace regex_backend {
 
-using MatchErrorMode = internal::MatchErrorMode;
+using ApproximateMode      = internal::ApproximateMode;
+using MatchErrorMode       = internal::MatchErrorMode;
+using MatchMetrics         = internal::MatchMetrics;
+using MatchMetricsSnapshot = internal::MatchMetricsSnapshot;
+using MatchOperation       = internal::MatchOperation;
+using ProductOperation     = internal::ProductOperation;
+using StructuralHash       = internal::StructuralHash;
+
+template <typename Machine_T, ApproximateMode MODE = ApproximateMode::Edits>
+using ApproximateScanner = internal::ApproximateScanner<Machine_T, MODE>;
+template <typename Machine_T> using DictionaryCursor = internal::DictionaryCursor<Machine_T>;
+template <typename Machine_T> using FuzzyLookup      = internal::FuzzyLookup<Machine_T>;
+template <typename Stored_T> using FuzzyMatch        = internal::FuzzyMatch<Stored_T>;
+template <typename Machine_T> using LazyProduct      = internal::LazyProduct<Machine_T>;
+template <typename Machine_T, bool HUGE_PAGES = false>
+using MultiScanner = internal::MultiScanner<Machine_T, HUGE_PAGES>;
+template <typename Machine_T, bool HUGE_PAGES = false>
+using PartitionedScanner = internal::PartitionedScanner<Machine_T, HUGE_PAGES>;
+
+using internal::complement;
+using internal::intersect;
+using internal::intersects;
+using internal::is_subset;
+using internal::partition_patterns;
+using internal::subtract;
+using internal::unite;
 
 template <typename Value_T,
           typename Transition_T,
@@ -58,6 +91,38 @@ public:
     return match_sequence(seq.c_str());
   }
 
+  StateMachine& insert_sequence(std::string const& seq) {
+    return Parent::insert_sequence(std::vector<char>(seq.begin(), seq.end()));
+  }
+
+  template <typename Val_T> StateMachine& insert_sequence(std::string const& seq, Val_T value) {
+    return Parent::insert_sequence(std::vector<char>(seq.begin(), seq.end()), value);
+  }
+
+  bool erase_sequence(std::string const& seq) {
+    return Parent::erase_sequence(std::vector<char>(seq.begin(), seq.end()));
+  }
+
+  ///
+  /// Find every key within 'max_edits' (Levenshtein) edits of 'query', in lexicographic order
+  ///
+  /// see FuzzyLookup, which should be kept around instead when making many lookups
+  ///
+  std::vector<internal::FuzzyMatch<Value_T>> fuzzy_lookup(std::string_view query, size_t max_edits) const {
+    std::vector<internal::FuzzyMatch<Value_T>> matches;
+    internal::FuzzyLookup<StateMachine> lookup(*this);
+    if constexpr (std::is_void_v<Value_T>) {
+      lookup.each(query, max_edits, [&](std::string_view key, size_t distance) {
+        matches.push_back({std::string(key), distance});
+      });
+    } else {
+      lookup.each(query, max_edits, [&](std::string_view key, Value_T const& value, size_t distance) {
+        matches.push_back({std::string(key), &value, distance});
+      });
+    }
+    return matches;
+  }
+
   StateMachine& match_any_of(char const* options) {
     std::vector<char> v;
     for (char const* o = options; *o != 0; o++) {
@@ -225,6 +290,18 @@ public:
     return *this;
   }
 
+  StateMachine& insert_sequence(std::string const& seq) {
+    return Parent::insert_sequence(split_str_as_utf_points(seq));
+  }
+
+  template <typename Val_T> StateMachine& insert_sequence(std::string const& seq, Val_T value) {
+    return Parent::insert_sequence(split_str_as_utf_points(seq), value);
+  }
+
+  bool erase_sequence(std::string const& seq) {
+    return Parent::erase_sequence(split_str_as_utf_points(seq));
+  }
+
   ///
   /// Matches visual whitespace characters
   /// defined at https://en.wikipedia.org/wiki/Whitespace_character
@@ -0,0 +1,497 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./builder.h"
+#include "./node.h"
+#include "../util/probes.h"
+#include "mutils/assert.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// The ways in which the languages of two machines may be combined
+///
+enum class ProductOperation {
+  Union,        // inputs matched by either machine, taking the left value where both match
+  Intersection, // inputs matched by both machines, taking the left value
+  Difference,   // inputs matched by the left machine, but not the right
+};
+
+///
+/// The product construction over two machines, where every state of the product is a pair of states
+/// (one from each machine, 0 being the dead state) which step in lockstep
+///
+/// only pairs reachable from the pair of roots are ever built, and pairs which can never accept under the
+/// operation (e.g a dead left state in an intersection) are folded into the dead state
+///
+template <typename Machine_T> class Product {
+  using Node_T      = typename Machine_T::Node_T;
+  using Key_T       = typename Node_T::Key_T;
+  using NodeValue_T = typename Node_T::Value_T;
+
+  struct KeyHash {
+    size_t operator()(Key_T const& key) const {
+      return key.hash();
+    }
+  };
+
+public:
+  using Pair = std::pair<size_t, size_t>;
+
+  ///
+  /// Whether the pair may still lead to an accepting state
+  ///
+  static bool alive(ProductOperation op, Pair pair) {
+    switch (op) {
+      case ProductOperation::Union: return pair.first != 0 || pair.second != 0;
+      case ProductOperation::Intersection: return pair.first != 0 && pair.second != 0;
+      case ProductOperation::Difference: return pair.first != 0;
+    }
+    return false;
+  }
+
+  ///
+  /// The value held by the pair, if the pair accepts
+  ///
+  static std::optional<NodeValue_T> accepts(ProductOperation op, Machine_T const& a, Machine_T const& b, Pair pair) {
+    auto const& left  = pair.first ? a.read_node(pair.first).value : std::nullopt;
+    auto const& right = pair.second ? b.read_node(pair.second).value : std::nullopt;
+    switch (op) {
+      case ProductOperation::Union: return left.has_value() ? left : right;
+      case ProductOperation::Intersection: return right.has_value() ? left : std::nullopt;
+      case ProductOperation::Difference: return right.has_value() ? std::nullopt : left;
+    }
+    return std::nullopt;
+  }
+
+  ///
+  /// Call 'on_transition(key, target)' for every transition out of 'pair' (including the default and eof
+  /// transitions), where a missing value transition of either side falls back to that side's default
+  ///
+  template <typename Callback_T>
+  static void each_transition(Machine_T const& a, Machine_T const& b, Pair pair, Callback_T&& on_transition) {
+    std::unordered_map<Key_T, Pair, KeyHash> targets;
+    size_t defaults[2] = {0, 0};
+    size_t eofs[2]     = {0, 0};
+
+    auto const collect = [&](Machine_T const& m, size_t node, size_t side) {
+      if (node == 0) {
+        return;
+      }
+      m.read_node(node).each_transition([&](Key_T key, size_t to) {
+        if (key == Key_T::def()) {
+          defaults[side] = to;
+        } else if (key == Key_T::eof()) {
+          eofs[side] = to;
+        } else {
+          auto& target = targets.try_emplace(key, Pair{SIZE_MAX, SIZE_MAX}).first->second;
+          (side ? target.second : target.first) = to;
+        }
+      });
+    };
+    collect(a, pair.first, 0);
+    collect(b, pair.second, 1);
+
+    for (auto& [key, target] : targets) {
+      if (target.first == SIZE_MAX) {
+        target.first = defaults[0];
+      }
+      if (target.second == SIZE_MAX) {
+        target.second = defaults[1];
+      }
+      on_transition(key, target);
+    }
+    on_transition(Key_T::def(), Pair{defaults[0], defaults[1]});
+    on_transition(Key_T::eof(), Pair{eofs[0], eofs[1]});
+  }
+
+  ///
+  /// Whether any input is accepted by the product of 'a' and 'b', without building it
+  ///
+  /// the pairs are searched breadth first, stopping at the first accepting pair
+  ///
+  static bool accepts_any(ProductOperation op, Machine_T const& a, Machine_T const& b) {
+    MUTILS_ASSERT(!a.has_calls() && !b.has_calls(), "Products do not follow call edges, see match_call()");
+    std::unordered_set<uint64_t> seen;
+    std::deque<Pair> pending;
+    auto const visit = [&](Pair pair) {
+      if (alive(op, pair) && seen.insert((uint64_t(pair.first) << 32) | pair.second).second) {
+        pending.push_back(pair);
+      }
+    };
+
+    visit({1, 1});
+    while (!pending.empty()) {
+      auto const pair = pending.front();
+      pending.pop_front();
+      if (accepts(op, a, b, pair).has_value()) {
+        return true;
+      }
+      each_transition(a, b, pair, [&](Key_T, Pair target) { visit(target); });
+    }
+    return false;
+  }
+
+  ///
+  /// A machine of a single accepting state which consumes anything
+  ///
+  static Machine_T anything() {
+    Machine_T machine;
+    machine.get_node(1).def() = 1;
+    machine.get_node(1).value = NodeValue_T{.back_by = 0};
+    return machine;
+  }
+
+  ///
+  /// The regex matching everything 'a' does not, as the difference between anything() and 'a'
+  ///
+  static Machine_T complement(Machine_T const& a) {
+    static_assert(Machine_T::IS_REGEX, "Only regexes may be complemented, there would be no values to attach");
+    return build(ProductOperation::Difference, anything(), a);
+  }
+
+  ///
+  /// Build the product of 'a' and 'b' as a new machine
+  ///
+  static Machine_T build(ProductOperation op, Machine_T const& a, Machine_T const& b) {
+    return build_within(op, a, b, SIZE_MAX).value();
+  }
+
+  ///
+  /// Build the product of 'a' and 'b' as a new machine, giving up once it needs more than 'max_states' states
+  ///
+  static std::optional<Machine_T> build_within(ProductOperation op,
+                                               Machine_T const& a,
+                                               Machine_T const& b,
+                                               size_t max_states) {
+    MUTILS_ASSERT(!a.has_calls() && !b.has_calls(), "Products do not follow call edges, see match_call()");
+    Machine_T result;
+    std::unordered_map<uint64_t, size_t> ids;
+    std::deque<Pair> pending;
+
+    auto const id_of = [&](Pair pair) -> size_t {
+      if (!alive(op, pair)) {
+        return 0;
+      }
+      auto const packed       = (uint64_t(pair.first) << 32) | pair.second;
+      auto const [it, is_new] = ids.try_emplace(packed, ids.size() + 1);
+      if (is_new) {
+        if (it->second != 1) {
+          result.new_node();
+        }
+        pending.push_back(pair);
+      }
+      return it->second;
+    };
+
+    MUTILS_ASSERT(a.m_nodes.size() < (size_t(1) << 32) && b.m_nodes.size() < (size_t(1) << 32),
+                  "The machines are too large for a product");
+    if (id_of({1, 1}) == 0) {
+      return result;
+    }
+    while (!pending.empty()) {
+      if (ids.size() > max_states) {
+        return std::nullopt;
+      }
+      auto const pair = pending.front();
+      pending.pop_front();
+      auto const id = ids[(uint64_t(pair.first) << 32) | pair.second];
+
+      Node_T node;
+      node.value = accepts(op, a, b, pair);
+      each_transition(a, b, pair, [&](Key_T key, Pair target) { node.transition(key) = id_of(target); });
+      result.get_node(id) = node;
+    }
+    result.drop_incremental_index();
+    return result;
+  }
+};
+
+///
+/// A product of two machines which is only built as far as inputs actually lead it
+///
+/// every product state owns a row of transitions for each input byte (and one for eof), which are resolved
+/// against the two machines the first time they are taken, so repeated scans settle into plain table lookups
+/// over exactly the states the inputs need. matches(), find() and scan() behave as they do for the compiled
+/// product, so a combination of filters may be scanned in a single pass without ever being built in full
+///
+/// Note: Lookups grow the product, so a lazy product may not be shared between threads, and both machines
+/// must outlive it and not be modified
+///
+template <typename Machine_T> class LazyProduct {
+  static_assert(std::is_same_v<typename Machine_T::input_t, char> && !Machine_T::IS_UTF8,
+                "Lazy products only support char machines");
+
+public:
+  using input_t      = typename Machine_T::input_t;
+  using match_result = typename Machine_T::match_result;
+  using find_result  = typename Machine_T::find_result;
+
+private:
+  using Pair = typename Product<Machine_T>::Pair;
+
+  constexpr static uint32_t UNRESOLVED = std::numeric_limits<uint32_t>::max();
+  constexpr static uint32_t DEAD       = 0;
+  constexpr static size_t ROW_STRIDE   = 256;
+
+  Machine_T const& m_a;
+  Machine_T const& m_b;
+  ProductOperation m_op;
+
+  std::vector<Pair> m_pairs;     // the pair behind every state, indexed by state id - 1
+  std::vector<bool> m_accepting; // whether every state accepts, indexed by state id - 1
+  std::vector<uint32_t> m_table; // ROW_STRIDE transitions for every state, including the dead state
+  std::vector<uint32_t> m_eof;   // the eof transition of every state, including the dead state
+  std::unordered_map<uint64_t, uint32_t> m_ids;
+
+public:
+  LazyProduct(ProductOperation op, Machine_T const& a, Machine_T const& b) : m_a(a), m_b(b), m_op(op) {
+    MUTILS_ASSERT(!a.has_calls() && !b.has_calls(), "Products do not follow call edges, see match_call()");
+    m_table.assign(ROW_STRIDE, DEAD);
+    m_eof.assign(1, DEAD);
+    state_of({1, 1});
+  }
+
+  ///
+  /// Equivalent to the matches() of the product machine
+  ///
+  template <bool const INCLUDE_EOF = false> match_result matches(std::span<input_t> input) {
+    uint32_t current = start();
+    for (auto c : input) {
+      if (current == DEAD) {
+        break;
+      }
+      current = step(current, static_cast<unsigned char>(c));
+    }
+    if constexpr (INCLUDE_EOF) {
+      if (current != DEAD) {
+        current = step_eof(current);
+      }
+    }
+
+    if (current == DEAD || !m_accepting[current - 1]) {
+      if constexpr (Machine_T::IS_REGEX) {
+        return false;
+      } else {
+        return static_cast<typename Machine_T::Stored_T const*>(nullptr);
+      }
+    }
+    if constexpr (Machine_T::IS_REGEX) {
+      return true;
+    } else {
+      return &value_of(current).value;
+    }
+  }
+
+  ///
+  /// Equivalent to the find() of the product machine
+  ///
+  find_result find(std::span<input_t> input) {
+    size_t match_begin, match_end;
+    if (auto const matched = find_from(input, 0, match_begin, match_end)) {
+      return result_of(input, match_begin, match_end, matched);
+    }
+    if constexpr (Machine_T::ERROR_MODE == MatchErrorMode::Return) {
+      return find_result(nullptr);
+    } else {
+      return find_result();
+    }
+  }
+
+  ///
+  /// Equivalent to the scan() of the compiled product machine, calling 'on_match' with every result
+  ///
+  /// scanning stops early after an empty match, returns the number of matches made
+  ///
+  template <typename Callback_T> size_t scan(std::span<input_t> input, Callback_T&& on_match) {
+    RB_PROBE1(scan__start, input.size());
+    size_t count = 0;
+    size_t begin = 0;
+    size_t match_begin, match_end;
+    while (auto const matched = find_from(input, begin, match_begin, match_end)) {
+      count++;
+      on_match(result_of(input, match_begin, match_end, matched));
+      if (match_end == match_begin) {
+        break;
+      }
+      begin = match_end;
+    }
+    RB_PROBE2(scan__done, input.size(), count);
+    return count;
+  }
+
+  ///
+  /// The number of product states built so far
+  ///
+  size_t states() const {
+    return m_pairs.size();
+  }
+
+private:
+  uint32_t start() const {
+    return m_pairs.empty() ? DEAD : 1;
+  }
+
+  // 'state_of' grows the table, so a resolved transition is only stored once it has returned
+  uint32_t step(uint32_t state, unsigned char c) {
+    auto const at = state * ROW_STRIDE + c;
+    if (m_table[at] == UNRESOLVED) {
+      auto const [p, q] = m_pairs[state - 1];
+      auto const next   = state_of({p ? m_a.read_node(p).byte_transition(c) : 0,
+                                    q ? m_b.read_node(q).byte_transition(c) : 0});
+      m_table[at]       = next;
+    }
+    return m_table[at];
+  }
+
+  uint32_t step_eof(uint32_t state) {
+    if (m_eof[state] == UNRESOLVED) {
+      auto const [p, q] = m_pairs[state - 1];
+      auto const next   = state_of({p ? m_a.read_node(p).get_eof() : 0, q ? m_b.read_node(q).get_eof() : 0});
+      m_eof[state]      = next;
+    }
+    return m_eof[state];
+  }
+
+  ///
+  /// The value held by an accepting state, only a union may take its value from the right
+  ///
+  auto const& value_of(uint32_t state) const {
+    auto const [p, q] = m_pairs[state - 1];
+    if (p != 0 && m_a.read_node(p).value.has_value()) {
+      return m_a.read_node(p).value.value();
+    }
+    return m_b.read_node(q).value.value();
+  }
+
+  ///
+  /// The first match of find() within input[begin:], as a range and the accepting state it ended on (or DEAD)
+  ///
+  uint32_t find_from(std::span<input_t> input, size_t begin, size_t& match_begin, size_t& match_end) {
+    uint32_t current = start();
+    uint32_t matched = DEAD;
+    match_begin = match_end = begin;
+    for (size_t i = begin; i < input.size() && current != DEAD; i++) {
+      auto const next = step(current, static_cast<unsigned char>(input[i]));
+      if (next != DEAD) {
+        current = next;
+        if (m_accepting[current - 1]) {
+          matched   = current;
+          match_end = i + 1;
+        }
+      } else if (matched == DEAD) {
+        // as in find(), the byte which failed is skipped
+        current     = start();
+        match_begin = match_end = i + 1;
+      } else {
+        break;
+      }
+    }
+    if (matched != DEAD) {
+      match_end -= value_of(matched).back_by;
+    }
+    return matched;
+  }
+
+  find_result result_of(std::span<input_t> input, size_t match_begin, size_t match_end, uint32_t matched) const {
+    auto range = std::span<input_t>(input.begin() + match_begin, input.begin() + match_end);
+    if constexpr (Machine_T::IS_REGEX) {
+      return find_result(range);
+    } else {
+      return find_result(range, &value_of(matched).value);
+    }
+  }
+
+  uint32_t state_of(Pair pair) {
+    if (!Product<Machine_T>::alive(m_op, pair)) {
+      return DEAD;
+    }
+    auto const packed       = (uint64_t(pair.first) << 32) | pair.second;
+    auto const [it, is_new] = m_ids.try_emplace(packed, m_pairs.size() + 1);
+    if (is_new) {
+      MUTILS_ASSERT_LT(m_pairs.size() + 1, UNRESOLVED / ROW_STRIDE, "The lazy product has grown too large");
+      m_pairs.push_back(pair);
+      m_accepting.push_back(Product<Machine_T>::accepts(m_op, m_a, m_b, pair).has_value());
+      m_table.resize(m_table.size() + ROW_STRIDE, UNRESOLVED);
+      m_eof.push_back(UNRESOLVED);
+    }
+    return it->second;
+  }
+};
+
+///
+/// The machine matching everything either machine matches, preferring the values of 'a'
+///
+template <typename Machine_T> Machine_T unite(Machine_T const& a, Machine_T const& b) {
+  return Product<Machine_T>::build(ProductOperation::Union, a, b);
+}
+
+///
+/// The machine matching everything both machines match, with the values of 'a'
+///
+template <typename Machine_T> Machine_T intersect(Machine_T const& a, Machine_T const& b) {
+  return Product<Machine_T>::build(ProductOperation::Intersection, a, b);
+}
+
+///
+/// The machine matching everything 'a' matches, but 'b' does not
+///
+template <typename Machine_T> Machine_T subtract(Machine_T const& a, Machine_T const& b) {
+  return Product<Machine_T>::build(ProductOperation::Difference, a, b);
+}
+
+///
+/// Whether some input is matched by both machines
+///
+template <typename Machine_T> bool intersects(Machine_T const& a, Machine_T const& b) {
+  return Product<Machine_T>::accepts_any(ProductOperation::Intersection, a, b);
+}
+
+///
+/// Whether every input matched by 'a' is also matched by 'b'
+///
+template <typename Machine_T> bool is_subset(Machine_T const& a, Machine_T const& b) {
+  return !Product<Machine_T>::accepts_any(ProductOperation::Difference, a, b);
+}
+
+///
+/// The regex matching everything 'a' does not
+///
+template <typename Machine_T> Machine_T complement(Machine_T const& a) {
+  return Product<Machine_T>::complement(a);
+}
+
+}; // namespace regex_backend::internal
@@ -0,0 +1,216 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./builder.h"
+#include "../util/probes.h"
+#include "mutils/assert.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
+namespace regex_backend::internal {
+
+///
+/// The errors tolerated by an ApproximateScanner
+///
+enum class ApproximateMode {
+  Mismatches, // substituted bytes only (hamming distance)
+  Edits,      // substituted, inserted and deleted bytes (levenshtein distance)
+};
+
+///
+/// A bit-parallel scanner for approximate occurrences of a small machine, tolerating up to 'max_errors' errors
+///
+/// the machine must be a simple chain of up to 64 states (a signature, where every position may be a set of
+/// bytes), which is turned into one bitmask per byte. The scanner then runs the Wu-Manber extension of the
+/// shift-and algorithm: one machine word per tolerated error, each updated with a handful of shifts and masks
+/// per input byte, so a scan is a single linear pass for any pattern of up to 64 positions
+///
+/// every occurrence is reported with the fewest errors it can be completed with, and the range of a match always
+/// spans as many bytes as the signature. With ApproximateMode::Edits the true start may differ from that by up to
+/// 'max_errors' bytes
+///
+template <typename Machine_T, ApproximateMode MODE = ApproximateMode::Edits> class ApproximateScanner {
+  static_assert(std::is_same_v<typename Machine_T::input_t, char> && !Machine_T::IS_UTF8,
+                "Approximate scanners only support char machines");
+
+public:
+  using input_t  = typename Machine_T::input_t;
+  using Stored_T = typename Machine_T::Stored_T;
+
+  constexpr static size_t MAX_LENGTH = 64;
+
+  struct match {
+    std::span<input_t> range;
+    size_t errors;
+    Stored_T const* value; // always null for regexes
+  };
+
+private:
+  std::array<uint64_t, 256> m_masks{}; // the positions accepting each byte
+  uint64_t m_final    = 0;             // the bit of the last position
+  size_t m_length     = 0;
+  size_t m_max_errors = 0;
+  Stored_T const* m_value = nullptr;
+
+public:
+  ApproximateScanner(Machine_T const& machine, size_t max_errors) : m_max_errors(max_errors) {
+    size_t node = 1;
+    while (!machine.read_node(node).value.has_value()) {
+      auto const& n = machine.read_node(node);
+      size_t next   = 0;
+      for (size_t c = 0; c < 256; c++) {
+        auto const to = n.byte_transition(c);
+        if (to == 0) {
+          continue;
+        }
+        MUTILS_ASSERT(next == 0 || next == to, "Approximate scanning requires a machine which is a simple chain");
+        next = to;
+        m_masks[c] |= uint64_t(1) << m_length;
+      }
+      MUTILS_ASSERT_NEQ(next, 0, "Approximate scanning requires a machine with an accepting state");
+      MUTILS_ASSERT_LT(m_length, MAX_LENGTH, "Approximate scanning supports machines of up to 64 positions");
+      m_length++;
+      node = next;
+    }
+
+    auto const& last = machine.read_node(node);
+    for (size_t c = 0; c < 256; c++) {
+      MUTILS_ASSERT_EQ(last.byte_transition(c), 0, "Approximate scanning requires a machine which is a simple chain");
+    }
+    MUTILS_ASSERT_NEQ(m_length, 0, "Approximate scanning requires a machine which does not accept empty input");
+    MUTILS_ASSERT_LT(max_errors, m_length, "Approximate scanning must tolerate fewer errors than the machine's length");
+    m_final = uint64_t(1) << (m_length - 1);
+    if constexpr (!std::is_void_v<Stored_T>) {
+      m_value = &last.value->value;
+    }
+  }
+
+  ///
+  /// Find the first approximate occurrence within 'input', i.e the one which ends earliest
+  ///
+  /// returns an empty range with errors > max_errors when there is none
+  ///
+  match find(std::span<input_t> input) const {
+    match result{.range = {}, .errors = m_max_errors + 1, .value = nullptr};
+    scan_until(input, [&](match const& m) {
+      result = m;
+      return false;
+    });
+    return result;
+  }
+
+  ///
+  /// Report every non-overlapping approximate occurrence within 'input' to 'on_match', in a single pass
+  ///
+  /// after each occurrence the search starts over from the following byte,
+  /// returns the number of occurrences
+  ///
+  template <typename Callback_T> size_t scan(std::span<input_t> input, Callback_T&& on_match) const {
+    RB_PROBE1(scan__start, input.size());
+    size_t count = 0;
+    scan_until(input, [&](match const& m) {
+      count++;
+      on_match(m);
+      return true;
+    });
+    RB_PROBE2(scan__done, input.size(), count);
+    return count;
+  }
+
+private:
+  ///
+  /// Run the automaton over 'input', passing every occurrence to 'on_match' until it returns false
+  ///
+  /// rows[e] holds a bit for every prefix of the signature which ends at the current byte with at most e errors
+  ///
+  template <typename Callback_T> void scan_until(std::span<input_t> input, Callback_T&& on_match) const {
+    using Rows = std::array<uint64_t, MAX_LENGTH>;
+    Rows rows;
+    auto const reset = [&]() {
+      for (size_t e = 0; e <= m_max_errors; e++) {
+        // with deletions, the first e positions may be skipped outright
+        rows[e] = MODE == ApproximateMode::Edits ? (uint64_t(1) << e) - 1 : 0;
+      }
+    };
+    auto const step = [&](Rows& r, input_t byte) {
+      auto const mask = m_masks[static_cast<unsigned char>(byte)];
+      auto previous   = r[0]; // r[e - 1], before this byte
+      r[0]            = ((r[0] << 1) | 1) & mask;
+      for (size_t e = 1; e <= m_max_errors; e++) {
+        auto const current = r[e];
+        auto next          = ((current << 1) | 1) & mask; // a matching byte
+        next |= (previous << 1) | 1;                      // a substituted byte
+        if constexpr (MODE == ApproximateMode::Edits) {
+          next |= previous;               // an inserted byte
+          next |= (r[e - 1] << 1) | 1;    // a deleted position
+        }
+        previous = current;
+        r[e]     = next;
+      }
+    };
+    auto const errors = [&](Rows const& r) {
+      size_t e = 0;
+      while (e <= m_max_errors && !(r[e] & m_final)) {
+        e++;
+      }
+      return e;
+    };
+
+    reset();
+    for (size_t i = 0; i < input.size(); i++) {
+      step(rows, input[i]);
+      auto best = errors(rows);
+      if (best > m_max_errors) {
+        continue;
+      }
+
+      // the occurrence may be completed with fewer errors a little further on (e.g "viru" then "virus"),
+      // which can only happen within the next 'best' bytes
+      size_t end = i + 1;
+      if constexpr (MODE == ApproximateMode::Edits) {
+        Rows ahead = rows;
+        for (size_t j = i + 1; j < input.size() && j <= i + best; j++) {
+          step(ahead, input[j]);
+          auto const e = errors(ahead);
+          if (e < best) {
+            best = e;
+            end  = j + 1;
+          }
+        }
+      }
+
+      auto const begin = end >= m_length ? end - m_length : 0;
+      if (!on_match(match{.range = input.subspan(begin, end - begin), .errors = best, .value = m_value})) {
+        return;
+      }
+      reset();
+      i = end - 1;
+    }
+  }
+};
+
+}; // namespace regex_backend::internal
@@ -24,14 +24,23 @@
 
 #include "./node.h"
 #include "./node_store.h"
+#include "../util/hash.h"
+#include "../util/probes.h"
 #include "mutils/assert.h"
 #include "mutils/panic.h"
 #include "mutils/stringify.h"
 #include <algorithm>
 #include <concepts>
 #include <cstddef>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <set>
 #include <span>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace regex_backend::internal {
@@ -47,16 +56,50 @@ enum class MatchErrorMode {
   Return /// Includes error info within the return values of match functions
 };
 
+///
+/// Bookkeeping for incremental updates of a minimized machine, see insert_sequence()
+///
+struct IncrementalIndex {
+  std::vector<size_t> in_degree;                  // transitions into each node, indexed by node id - 1
+  std::unordered_multimap<size_t, size_t> states; // state hash -> node id, for every state off the updated path
+  std::vector<size_t> free;                       // nodes released by earlier updates, reused before growing
+};
+
 ///
 /// Here we hold state exclusive to constructible / dynamically allocated state machines
 ///
 template <bool IS_DYNAMIC> struct StateMachineConstructionState {
   ConflictAction on_conflict  = ConflictAction::Error;
   std::vector<size_t> cursors = {1};
+
+  // built by the first incremental update, and dropped by any other modification
+  // copies leave it behind, so cloning a machine stays proportional to its changed pages
+  std::optional<IncrementalIndex> index;
+
+  StateMachineConstructionState() = default;
+  StateMachineConstructionState(StateMachineConstructionState&&) = default;
+  StateMachineConstructionState& operator=(StateMachineConstructionState&&) = default;
+  StateMachineConstructionState(StateMachineConstructionState const& other)
+      : on_conflict(other.on_conflict), cursors(other.cursors) {
+  }
+  StateMachineConstructionState& operator=(StateMachineConstructionState const& other) {
+    on_conflict = other.on_conflict;
+    cursors     = other.cursors;
+    index.reset();
+    return *this;
+  }
 };
 
 template <> struct StateMachineConstructionState<false> {};
 
+template <typename Machine_T, bool HUGE_PAGES = false> class CompiledStateMachine;
+template <typename Machine_T> class DictionaryCursor;
+template <typename Machine_T> class FuzzyLookup;
+enum class ApproximateMode;
+template <typename Machine_T, ApproximateMode MODE> class ApproximateScanner;
+template <typename Machine_T> class Product;
+template <typename Machine_T> class LazyProduct;
+
 template <typename Value_T,                  // Type of values held at regex lookups
           typename Transition_T,             // Type which transitions are based on
           typename Self,                     // class inheriting the statemachine
@@ -78,24 +121,59 @@ class StateMachine {
   static constexpr bool IS_DYNAMIC      = !IS_PREALLOCATED;
   static constexpr bool IS_UTF8         = std::is_same_v<Transition_T, char32_t>;
 
-  using Node_T = StateMachineNode<Value_T, Transition_T, IS_DYNAMIC>;
+  using Node_T   = StateMachineNode<Value_T, Transition_T, IS_DYNAMIC>;
+  using Stored_T = Value_T;
   // using Self   = StateMachine;
 
+  static constexpr MatchErrorMode ERROR_MODE = ON_MATCH_ERROR;
+
+  template <typename Machine_T, bool HUGE_PAGES> friend class CompiledStateMachine;
+  template <typename Machine_T> friend class DictionaryCursor;
+  template <typename Machine_T> friend class FuzzyLookup;
+  template <typename Machine_T, ApproximateMode MODE> friend class ApproximateScanner;
+  template <typename Machine_T> friend class Product;
+  template <typename Machine_T> friend class LazyProduct;
+
   StateMachineNodeStore<Node_T, STATIC_NODE_COUNT> m_nodes;
 
   StateMachineConstructionState<!IS_PREALLOCATED> construction_state;
 
+  template <typename, typename, typename, std::size_t, MatchErrorMode> friend class StateMachine;
+
+  ///
+  /// An edge which runs a shared sub-machine from 'from', continuing from 'to' once the sub-machine accepts
+  ///
+  /// a null callee is a call of the machine holding the edge. It is not held by pointer, so the machine does not
+  /// keep itself alive, and a copy of the machine calls the copy
+  ///
+  struct CallEdge {
+    size_t from;
+    std::shared_ptr<StateMachine<void, Transition_T, Self, 0, ON_MATCH_ERROR> const> callee;
+    size_t to;
+  };
+
+  std::vector<CallEdge> m_calls;
+
 public:
   using MutableRegex = StateMachine<void, Transition_T, Self, 0, ON_MATCH_ERROR>;
   // using Self_T = Self;
   typedef Self Self_T;
 
+  static constexpr size_t REPEAT_UNBOUNDED = std::numeric_limits<size_t>::max();
+
+  // sub-machines of up to this many nodes (and without calls of their own) are inlined by match_call()
+  static constexpr size_t CALL_INLINE_NODES = 32;
+
+  // the deepest nesting of calls followed by matches()
+  static constexpr size_t MAX_CALL_DEPTH = 32;
+
   ///
   /// Construct a static state-machine from a pre-existing dynamic one
   ///
   /// Note: You must know the size of the dynamic state machine to construct this
-  constexpr StateMachine(StateMachine<Value_T, Transition_T, Self, 0, ON_MATCH_ERROR> from)
-    requires(IS_PREALLOCATED)
+  template <std::size_t FROM_NODE_COUNT = 0>
+  constexpr StateMachine(StateMachine<Value_T, Transition_T, Self, FROM_NODE_COUNT, ON_MATCH_ERROR> const& from)
+    requires(IS_PREALLOCATED && FROM_NODE_COUNT == 0)
   {
     MUTILS_ASSERT_EQ(
         from.m_nodes.size(),
@@ -131,6 +209,7 @@ public:
   Self& match_default()
     requires IS_DYNAMIC
   {
+    drop_incremental_index();
     auto& default_node              = new_node();
     auto default_node_idx           = node_index(default_node);
     std::vector<size_t> new_cursors = {default_node_idx};
@@ -168,6 +247,7 @@ public:
   Self& match_eof()
     requires IS_DYNAMIC
   {
+    drop_incremental_index();
     cursor_transition(Node_T::Key_T::eof());
     return *(Self*)this;
   };
@@ -184,48 +264,14 @@ public:
   Self& match_any_of(std::vector<Transition_T> options)
     requires IS_DYNAMIC
   {
+    drop_incremental_index();
     auto& target = new_node();
     auto tidx    = node_index(target);
     std::vector<size_t> new_cursors;
     auto initial_cursors = construction_state.cursors;
     for (auto choice : options) {
-
-      if constexpr (IS_UTF8) {
-
-        constexpr char32_t byte = 0xFF;
-        // constexpr char32_t byte_msb = 128;
-
-        // constexpr char32_t byte_dropbit = byte_msb >> 1;
-        constexpr char32_t drop_mask = 0b10111111;
-
-
-        char32_t key = choice;
-        // the key is treated as an array of 4 utf8 bytes
-
-        if (key & (byte << 24)) {
-          // 4-wide utf8 char
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 24) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 16) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 8) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value(key & drop_mask));
-
-        } else if (key & (byte << 16)) {
-          // 3-wide utf8 char
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 16) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 8) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value(key & drop_mask));
-        } else if (key & (byte << 8)) {
-          // 2-wide utf8 char
-          cursor_discreet_transition(Node_T::Key_T::value((key >> 8) & drop_mask));
-          cursor_discreet_transition(Node_T::Key_T::value(key & drop_mask));
-        } else {
-          // 1-wide utf8 char  / treat as regular ascii character
-          MUTILS_ASSERT((key & 128) == 0, "The MSB was found to be set in an ascii character");
-          cursor_discreet_transition(Node_T::Key_T::value(key));
-        }
-      } else {
-
-        cursor_discreet_transition(Node_T::Key_T::value(choice));
+      for (auto key : encode_keys(choice)) {
+        cursor_discreet_transition(key);
       }
       // gather all the new cursors
       std::for_each(construction_state.cursors.begin(), construction_state.cursors.end(), [&](auto c) {
@@ -240,6 +286,7 @@ public:
   Self& match(MutableRegex pattern)
     requires IS_DYNAMIC
   {
+    drop_incremental_index();
     merge_regex_into_machine(pattern);
     return *(Self*)this;
   };
@@ -248,9 +295,121 @@ public:
     return match(pattern).match_many_optionally(pattern);
   }
 
+  ///
+  /// Match 'pattern' between 'min' and 'max' times (inclusive), i.e pattern{min,max}
+  /// pass REPEAT_UNBOUNDED as 'max' for pattern{min,}
+  ///
+  /// the pattern is read once, and every repetition is written straight out of it rather than merging a
+  /// fresh copy of the pattern each time, so building costs time linear in the size of the result
+  ///
+  Self& match_repeat(MutableRegex const& pattern, size_t min, size_t max)
+    requires IS_DYNAMIC
+  {
+    MUTILS_ASSERT_LTE(min, max, "A repetition may not have a higher minimum than maximum");
+    drop_incremental_index();
+
+    // read the pattern once: the transitions out of its root, and its terminals
+    auto const& nodes = std::as_const(pattern.m_nodes);
+    std::vector<std::pair<typename Node_T::Key_T, size_t>> entries;
+    nodes[0].each_transition([&](auto key, size_t to) { entries.emplace_back(key, to); });
+    std::vector<size_t> pattern_terminals;
+    for (size_t i = 1; i < nodes.size(); i++) {
+      if (nodes[i].value.has_value()) {
+        pattern_terminals.push_back(i + 1);
+      }
+    }
+
+    // write out one more repetition after the cursors, and move the cursors onto its terminals
+    auto const repeat_once = [&]() {
+      auto const base = m_nodes.size() - 1;
+      for (size_t i = 1; i < nodes.size(); i++) {
+        Node_T n;
+        nodes[i].each_transition([&](auto key, size_t to) { n.transition(key) = to + base; });
+        m_nodes.push(n);
+      }
+      std::vector<size_t> terminals;
+      for (auto t : pattern_terminals) {
+        terminals.push_back(t + base);
+      }
+      for (auto cursor : construction_state.cursors) {
+        for (auto const& [key, to] : entries) {
+          auto& transition = get_node(cursor).transition(key);
+          if (transition == 0) {
+            transition = to + base;
+            continue;
+          }
+          auto replaced = make_nonambiguous_link(cursor, key, to + base, terminals);
+          terminals.insert(terminals.end(), replaced.begin(), replaced.end());
+        }
+      }
+      construction_state.cursors = terminals;
+    };
+
+    if (max == REPEAT_UNBOUNDED) {
+      for (size_t i = 0; i < min; i++) {
+        repeat_once();
+      }
+      return match_many_optionally(pattern);
+    }
+
+    // every count from min onwards is a way out of the repetition
+    std::vector<size_t> exits;
+    if (min == 0) {
+      exits = construction_state.cursors;
+    }
+    for (size_t i = 1; i <= max; i++) {
+      repeat_once();
+      if (i >= min) {
+        exits.insert(exits.end(), construction_state.cursors.begin(), construction_state.cursors.end());
+      }
+    }
+    std::sort(exits.begin(), exits.end());
+    exits.erase(std::unique(exits.begin(), exits.end()), exits.end());
+    construction_state.cursors = exits;
+    return *(Self*)this;
+  }
+
+  ///
+  /// Match a shared sub-machine, without copying it into this machine
+  ///
+  /// small sub-machines are simply inlined, as with match(). Larger ones (or ones which make calls of their own)
+  /// are linked by a call edge, which matches() follows with a return stack of up to MAX_CALL_DEPTH calls. A
+  /// sub-machine used in many places is then stored only once, and may call itself (e.g for nested comments)
+  ///
+  /// Note: call edges are only followed by matches(). Machines with call edges cannot be compiled, searched with
+  /// find(), or updated incrementally
+  ///
+  Self& match_call(std::shared_ptr<MutableRegex const> callee)
+    requires IS_DYNAMIC
+  {
+    MUTILS_ASSERT(callee != nullptr, "Attempt to call a null sub-machine");
+    // a machine calling itself is still under construction, and is never inlined
+    bool const recursive = static_cast<void const*>(callee.get()) == static_cast<void const*>(this);
+    if (!recursive && callee->m_calls.empty() && callee->m_nodes.size() <= CALL_INLINE_NODES) {
+      return match(*callee);
+    }
+
+    drop_incremental_index();
+    new_node();
+    auto const to = m_nodes.size();
+    for (auto cursor : construction_state.cursors) {
+      m_calls.push_back({cursor, recursive ? nullptr : callee, to});
+    }
+    construction_state.cursors = {to};
+    return *(Self*)this;
+  }
+
+  ///
+  /// Whether the machine holds any call edges, see match_call()
+  ///
+  bool has_calls() const {
+    return !m_calls.empty();
+  }
+
   Self& match_many_optionally(MutableRegex pattern)
     requires IS_DYNAMIC
   {
+    drop_incremental_index();
     auto cursors_before = construction_state.cursors;
 
     auto res             = consume_regex_except_root(pattern);
@@ -303,6 +462,7 @@ public:
   Self& exit_point(size_t back_by = 0)
     requires(IS_REGEX && IS_DYNAMIC)
   {
+    drop_incremental_index();
     std::vector<std::string> errors;
     for (auto cur : construction_state.cursors) {
       Node_T& node = get_node(cur);
@@ -344,6 +504,54 @@ public:
     return *(Self*)this;
   };
 
+  ///
+  /// Set an exit point for a state machine holding values
+  ///
+  /// the given value is attached to every cursor, and is returned by
+  /// the match methods whenever they finish on one of these nodes
+  ///
+  /// back_by behaves the same as it does for regex exit points
+  ///
+  template <typename Val_T>
+  Self& exit_point(Val_T value, size_t back_by = 0)
+    requires(HAS_VALUE && IS_DYNAMIC && std::is_convertible_v<Val_T, Value_T>)
+  {
+    drop_incremental_index();
+    typename Node_T::Value_T v;
+    v.value   = value;
+    v.back_by = back_by;
+
+    std::vector<std::string> errors;
+    for (auto cur : construction_state.cursors) {
+      Node_T& node = get_node(cur);
+
+      if (node.value.has_value() && node.value.value() != v) {
+        switch (construction_state.on_conflict) {
+          case ConflictAction::Skip: continue;
+          case ConflictAction::Overwrite: node.value = v; continue;
+          case ConflictAction::Error: {
+            errors.push_back("In node #" + std::to_string(cur) + ", the existing value of '" +
+                             mutils::stringify(node.value.value().value) + "' was attempted to be replaced with '" +
+                             mutils::stringify(value) + "'");
+            continue;
+          }
+        }
+      }
+      node.value = v;
+    }
+
+    if (errors.size()) {
+      std::string msg = "An error was encountered while generating an exit-point to a state machine\n";
+      for (auto e : errors) {
+        msg += e + "\n";
+      }
+      msg += "\nTo solve these errors, either make non-ambiguous state machines, or update the conflict behavior";
+      mutils::PANIC(msg);
+    }
+
+    return *(Self*)this;
+  };
+
   /**
    * Dump a textual representation of the state machine to
    * stdout
@@ -384,19 +592,280 @@ public:
   Self_T& optimize()
     requires IS_DYNAMIC
   {
-    nullify_nullrefs();
-    remove_duplicates();
-    nullify_nullrefs();
-    remove_duplicates();
-    nullify_orphans();
-    remove_blanks();
+    drop_incremental_index();
+    RB_PROBE1(optimize__start, m_nodes.size());
+    traced_pass("nullify_nullrefs", [&] { nullify_nullrefs(); });
+    traced_pass("remove_duplicates", [&] { remove_duplicates(); });
+    traced_pass("nullify_nullrefs", [&] { nullify_nullrefs(); });
+    traced_pass("remove_duplicates", [&] { remove_duplicates(); });
+    traced_pass("nullify_orphans", [&] { nullify_orphans(); });
+    traced_pass("remove_blanks", [&] { remove_blanks(); });
+    traced_pass("renumber", [&] { renumber(); });
     // construction_state.cursors = {1};
+    RB_PROBE1(optimize__done, m_nodes.size());
+
+    return *(Self_T*)this;
+  }
+
+  ///
+  /// Reorder the nodes of the machine so that states which are visited together
+  /// sit next to each other in memory
+  ///
+  /// without a profile, nodes are numbered breadth-first from the root, which keeps
+  /// the shallow (and typically hottest) states within the first few cache lines
+  ///
+  /// with a profile (see record_visits), nodes are ordered by descending visit count,
+  /// ties are broken by breadth-first depth
+  ///
+  /// the root always remains node #1, and the null transition (0) remains the dead state
+  ///
+  Self_T& renumber(std::vector<size_t> const& visits = {})
+    requires IS_DYNAMIC
+  {
+    drop_incremental_index();
+    // breadth-first walk from the root
+    std::vector<size_t> order = {1};
+    std::vector<bool> seen(m_nodes.size(), false);
+    seen[0] = true;
+    for (size_t i = 0; i < order.size(); i++) {
+      read_node(order[i]).each_transition([&](auto k, size_t t) {
+        if (!seen[t - 1]) {
+          seen[t - 1] = true;
+          order.push_back(t);
+        }
+      });
+    }
+
+    // unreachable nodes (i.e null nodes held by cursors) are kept at the end
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+      if (!seen[i]) {
+        order.push_back(i + 1);
+      }
+    }
+
+    if (visits.size()) {
+      MUTILS_ASSERT_EQ(visits.size(), m_nodes.size(), "The visit profile does not match the size of the machine");
+      std::stable_sort(order.begin() + 1, order.end(), [&](size_t a, size_t b) {
+        return visits[a - 1] > visits[b - 1];
+      });
+    }
+
+    reorder_nodes(order);
+    return *(Self_T*)this;
+  }
+
+  ///
+  /// Add a sequence to a minimized machine, updating only the states along its path
+  ///
+  /// states shared with other sequences are cloned, the new suffix is appended, and the path is then
+  /// re-minimized bottom-up against a register of the existing states. For acyclic machines (i.e dictionaries)
+  /// the result is exactly as minimal as a fresh optimize(), at a cost proportional to the sequence length
+  ///
+  /// the first incremental update indexes the machine in a single linear pass, that index is kept
+  /// until the machine is modified by any other means. Incremental updates leave the cursor at the root
+  ///
+  /// conflicting values are resolved with the conflict() setting, as they are in exit_point()
+  ///
+  /// Note: states along the path may not hold default transitions
+  ///
+  Self_T& insert_sequence(std::vector<Transition_T> seq)
+    requires(IS_REGEX && IS_DYNAMIC)
+  {
+    typename Node_T::Value_T v;
+    v.back_by = 0;
+    insert_keys(encode_sequence(seq), v);
+    return *(Self_T*)this;
+  }
+
+  template <typename Val_T>
+  Self_T& insert_sequence(std::vector<Transition_T> seq, Val_T value)
+    requires(HAS_VALUE && IS_DYNAMIC && std::is_convertible_v<Val_T, Value_T>)
+  {
+    typename Node_T::Value_T v;
+    v.value   = value;
+    v.back_by = 0;
+    insert_keys(encode_sequence(seq), v);
+    return *(Self_T*)this;
+  }
+
+  ///
+  /// Remove a sequence previously added to a minimized machine, see insert_sequence()
+  ///
+  /// the sequence stops being accepted, branches which no longer lead to an exit point are pruned,
+  /// and the remaining path is re-minimized
+  ///
+  /// returns false (and leaves the machine untouched) if the sequence was not accepted
+  ///
+  bool erase_sequence(std::vector<Transition_T> seq)
+    requires IS_DYNAMIC
+  {
+    auto const keys = encode_sequence(seq);
+
+    size_t node = 1;
+    for (auto key : keys) {
+      size_t next = 0;
+      read_node(node).each_transition([&](auto k, size_t t) {
+        if (k == key) {
+          next = t;
+        }
+      });
+      node = next;
+      if (node == 0) {
+        return false;
+      }
+    }
+    if (!read_node(node).value.has_value()) {
+      return false;
+    }
+
+    auto& index = incremental_index();
+    auto path   = unshare_path(index, keys);
+    get_node(path.back()).value.reset();
+
+    // prune the tail of the path which no longer leads anywhere
+    while (path.size() > 1 && get_node(path.back()).is_null()) {
+      auto const dead = path.back();
+      path.pop_back();
+      retarget(index, path.back(), keys[path.size() - 1], 0);
+      release_state(index, dead);
+    }
+
+    minimize_path(index, path, keys);
+    return true;
+  }
+
+  ///
+  /// Stop accepting every sequence which leads to 'value'
+  ///
+  /// the exit points holding the value are unmarked, the states which no longer lead anywhere are pruned
+  /// backwards from them, and only the states around the removal are re-minimized against the register kept for
+  /// incremental updates (see insert_sequence()), which is kept for later updates
+  ///
+  /// Note: finding the exit points, and the states leading into them, still takes a single scan of the whole
+  /// machine, as neither is indexed
+  ///
+  /// returns the number of exit points which were removed
+  ///
+  template <typename Val_T>
+  size_t remove_value(Val_T value)
+    requires(HAS_VALUE && IS_DYNAMIC && std::is_convertible_v<Val_T, Value_T>)
+  {
+    auto& index = incremental_index();
+    std::vector<std::vector<size_t>> predecessors(m_nodes.size());
+    std::vector<size_t> affected;
+    for (size_t id = 1; id <= m_nodes.size(); id++) {
+      auto const& n = read_node(id);
+      n.each_transition([&](auto k, size_t t) {
+        predecessors[t - 1].push_back(id);
+      });
+      if (n.value.has_value() && n.value->value == value) {
+        affected.push_back(id);
+      }
+    }
+    if (affected.empty()) {
+      return 0;
+    }
+
+    auto const removed = affected.size();
+    for (auto id : affected) {
+      unregister_state(index, id);
+      get_node(id).value.reset();
+    }
+
+    // prune the states which no longer lead anywhere, the states leading into them may then be pruned in turn
+    auto const leads_nowhere = [&](size_t id) {
+      bool any = read_node(id).value.has_value();
+      read_node(id).each_transition([&](auto k, size_t t) {
+        any = true;
+      });
+      return !any;
+    };
+    std::vector<size_t> pending = affected;
+    while (!pending.empty()) {
+      auto const id = pending.back();
+      pending.pop_back();
+      if (id == 1 || index.in_degree[id - 1] == 0 || !leads_nowhere(id)) {
+        continue;
+      }
+      for (auto pred : predecessors[id - 1]) {
+        if (index.in_degree[id - 1] == 0) {
+          break;
+        }
+        unregister_state(index, pred);
+        get_node(pred).each_transition([&](auto k, auto& t) {
+          if (t == id) {
+            t = 0;
+            index.in_degree[id - 1]--;
+          }
+        });
+        pending.push_back(pred);
+        affected.push_back(pred);
+      }
+      release_state(index, id);
+    }
+
+    minimize_from(index, affected, predecessors);
+    return removed;
+  }
+
+  ///
+  /// Free the bookkeeping kept between incremental updates (see insert_sequence())
+  ///
+  /// it is rebuilt by the next incremental update, which is worth avoiding for the many
+  /// copies of a shared base machine, which otherwise each hold an index of the whole machine
+  ///
+  void drop_incremental_index()
+    requires IS_DYNAMIC
+  {
+    construction_state.index.reset();
+  }
 
+  ///
+  /// Drop the nodes released by incremental updates, and renumber the machine
+  ///
+  Self_T& compact()
+    requires IS_DYNAMIC
+  {
+    drop_incremental_index();
+    traced_pass("remove_blanks", [&] { remove_blanks(); });
+    traced_pass("renumber", [&] { renumber(); });
     return *(Self_T*)this;
   }
 
+  ///
+  /// Whether the machine accepts no input at all, i.e no accepting state is reachable from the root
+  ///
+  /// the search stops at the first accepting state found
+  ///
+  bool is_empty() const
+    requires IS_DYNAMIC
+  {
+    MUTILS_ASSERT(m_calls.empty(), "is_empty() does not follow call edges, see match_call()");
+    std::vector<bool> seen(m_nodes.size(), false);
+    std::vector<size_t> pending{1};
+    seen[0] = true;
+    while (!pending.empty()) {
+      auto const& node = read_node(pending.back());
+      pending.pop_back();
+      if (node.value.has_value()) {
+        return false;
+      }
+      node.each_transition([&](auto, size_t to) {
+        if (!seen[to - 1]) {
+          seen[to - 1] = true;
+          pending.push_back(to);
+        }
+      });
+    }
+    return true;
+  }
+
   ////////////////////////////////////////////////////
   /// STATE MACHINE LOOKUP / SEARCH FUNCTIONALITIES
+  ///
+  /// every lookup is const, and keeps its working state on the stack (or in caller-provided
+  /// buffers, see record_visits), so a machine may be shared between any number of reading threads
+  /// as long as nothing is modifying it
   ////////////////////////////////////////////////////
 
 
@@ -520,6 +989,11 @@ public:
     /// value + error constructor
     ///
     match_result_t(Val_T const* val) : dat(val){};
+
+    ///
+    /// no-match constructor
+    ///
+    match_result_t() : dat(nullptr){};
   };
 
   template <> struct match_result_t<void> : match_maybe_error {
@@ -547,11 +1021,60 @@ public:
     /// value + error constructor
     ///
     match_result_t(bool has_val) : has_value(has_val){};
+
+    ///
+    /// no-match constructor
+    ///
+    match_result_t() : has_value(false){};
   };
 
   using find_result  = find_result_t<Value_T>;
   using match_result = match_result_t<Value_T>;
 
+  ///
+  /// Scan the input through the machine, and count the number of times each node is entered
+  ///
+  /// the input is scanned as a stream of find() calls would scan it, and the counts are
+  /// accumulated into 'visits' (indexed by node id - 1), so it may be reused across many
+  /// recorded inputs before being handed to renumber()
+  ///
+  void record_visits(std::span<input_t> input, std::vector<size_t>& visits) const {
+    visits.resize(m_nodes.size(), 0);
+
+    // as in find(), a failing byte is skipped unless a match is pending, in which case the next find()
+    // starts over from the end of that match (so the bytes after it are read, and counted, again)
+    size_t begin = 0;
+    do {
+      size_t current     = 1;
+      size_t match_begin = begin;
+      size_t match_end   = begin;
+      bool matched       = false;
+      visits[0]++;
+      for (size_t i = begin; i < input.size(); i++) {
+        auto next = m_nodes[current - 1].rt_get_transition(input[i]);
+        if (next) {
+          current = next;
+          visits[current - 1]++;
+          if (m_nodes[current - 1].value.has_value()) {
+            matched   = true;
+            match_end = i + 1 - m_nodes[current - 1].value->back_by;
+          }
+        } else if (!matched) {
+          current     = 1;
+          match_begin = i + 1;
+          visits[0]++;
+        } else {
+          break;
+        }
+      }
+      // a stream of find() calls ends with the input, or at the first empty match
+      if (!matched || match_end <= match_begin) {
+        break;
+      }
+      begin = match_end;
+    } while (begin < input.size());
+  }
+
   ///
   /// A utility for validating utf sequences
   ///
@@ -624,6 +1147,7 @@ public:
 #define err(msg)                                                                                                       \
   if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
   else return {msg};
+    MUTILS_ASSERT(m_calls.empty(), "find() does not follow call edges, see match_call()");
 
     size_t current_node               = 1;
     size_t most_specific_matched_node = 0;
@@ -778,15 +1302,20 @@ public:
   ///
   /// Note: the back_by setting has no effect in this function
   ///
-  template <bool const INCLUDE_EOF = false> match_result matches(std::span<input_t> input) {
+  template <bool const INCLUDE_EOF = false> match_result matches(std::span<input_t> input) const {
 #define err(msg)                                                                                                       \
   if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
   else return {msg};
+    if constexpr (IS_DYNAMIC) {
+      if (!m_calls.empty()) {
+        return matches_with_calls<INCLUDE_EOF>(input);
+      }
+    }
     constexpr auto null_val = [&]() {
       if constexpr (IS_REGEX) {
         return false;
       } else {
-        return nullptr;
+        return static_cast<Value_T const*>(nullptr);
       }
     }();
     size_t current    = 1;
@@ -828,7 +1357,7 @@ public:
       if constexpr (IS_REGEX) {
         return true;
       } else {
-        return &m_nodes[current - 1].value.value();
+        return &m_nodes[current - 1].value.value().value;
       }
     } else {
       return null_val;
@@ -836,27 +1365,181 @@ public:
 #undef err
   }
 
-
-protected:
   ///
-  /// Traverses the entire node chain and converts any transitions to null nodes into
-  /// null transitions, this nullification bubbles up
-  /// all the way to the root
+  /// Freeze the machine into a flat, table-driven form which is much cheaper to scan
+  /// see CompiledStateMachine for details
   ///
-  void nullify_nullrefs() {
-    std::vector<bool> nulls(m_nodes.size(), false);
-
-    size_t i = 0;
-    for (Node_T& n : m_nodes) {
-      if (is_deletable_node(i + 1)) {
-        nulls[i] = true;
-      }
-      i++;
-    }
-
+  /// the HUGE_PAGES option backs the transition table with 2MB pages where the platform allows it
+  ///
+  /// Note: the machine should be optimized before it is compiled
+  ///
+  template <bool HUGE_PAGES = false>
+  CompiledStateMachine<StateMachine, HUGE_PAGES> compile() const
+    requires(IS_DYNAMIC && (IS_UTF8 || std::is_same_v<Transition_T, char>))
+  {
+    MUTILS_ASSERT(m_calls.empty(), "Machines with call edges cannot be compiled, see match_call()");
+    return CompiledStateMachine<StateMachine, HUGE_PAGES>(*this);
+  }
 
-    while (true) {
-      bool has_nulled = false;
+  ////////////////////////////////////////////////////
+  /// STRUCTURAL IDENTITY
+  ///
+  /// states are identified by their canonical number: the order in which a breadth-first walk
+  /// from the root reaches them, following transitions in key order. This does not depend on the
+  /// order nodes were created in (or on renumber()), and unreachable nodes take no part in it
+  ////////////////////////////////////////////////////
+
+  ///
+  /// A 128 bit hash of the machine's structure
+  ///
+  /// equal machines (see operator==) always hash equally, so optimized machines
+  /// may be cached and deduplicated by their hash
+  ///
+  /// Note: unequal machines may still (very rarely) share a hash. Where a collision must never go
+  /// unnoticed, compare the machines with operator== as well
+  ///
+  StructuralHash structural_hash() const
+    requires IS_DYNAMIC
+  {
+    StructuralHash hash;
+    std::vector<size_t> canonical(m_nodes.size(), 0);
+    std::vector<size_t> order = {1};
+    canonical[0]              = 1;
+
+    for (size_t i = 0; i < order.size(); i++) {
+      auto const& node = m_nodes[order[i] - 1];
+      hash.mix(node.value.has_value() ? node.value->back_by + 1 : 0);
+      if constexpr (HAS_VALUE) {
+        if (node.value.has_value()) {
+          hash.mix(hash_value(node.value->value));
+        }
+      }
+
+      node.each_transition([&](auto key, size_t to) {
+        if (!canonical[to - 1]) {
+          order.push_back(to);
+          canonical[to - 1] = order.size();
+        }
+        hash.mix(key.hash());
+        hash.mix(canonical[to - 1]);
+      });
+      for (auto const call : calls_from(order[i])) {
+        if (!canonical[call->to - 1]) {
+          order.push_back(call->to);
+          canonical[call->to - 1] = order.size();
+        }
+        hash.mix(reinterpret_cast<uintptr_t>(call->callee.get()));
+        hash.mix(canonical[call->to - 1]);
+      }
+      hash.mix(~uint64_t(0));
+    }
+    return hash.finish();
+  }
+
+  ///
+  /// Two machines are equal when their reachable states correspond one to one, holding the same values
+  /// and transitioning on the same keys into corresponding states
+  ///
+  /// Note: this is structural equality, machines recognizing the same language are only guaranteed
+  /// to compare equal if both are minimal. Call edges must call the very same sub-machines
+  ///
+  bool operator==(StateMachine const& other) const
+    requires IS_DYNAMIC
+  {
+    struct Edge {
+      typename Node_T::Key_T key;
+      size_t to;
+    };
+
+    std::vector<size_t> to_other(m_nodes.size(), 0);
+    std::vector<size_t> from_other(other.m_nodes.size(), 0);
+    std::vector<size_t> queue = {1};
+    to_other[0]               = 1;
+    from_other[0]             = 1;
+
+    std::vector<Edge> edges;
+    std::vector<Edge> other_edges;
+    for (size_t i = 0; i < queue.size(); i++) {
+      auto const& node       = m_nodes[queue[i] - 1];
+      auto const& other_node = other.m_nodes[to_other[queue[i] - 1] - 1];
+      if (node.value != other_node.value) {
+        return false;
+      }
+
+      edges.clear();
+      other_edges.clear();
+      node.each_transition([&](auto key, size_t to) {
+        edges.push_back({key, to});
+      });
+      other_node.each_transition([&](auto key, size_t to) {
+        other_edges.push_back({key, to});
+      });
+      if (edges.size() != other_edges.size()) {
+        return false;
+      }
+
+      // call edges are matched up like transitions, keyed by the sub-machine they call
+      auto const calls       = calls_from(queue[i]);
+      auto const other_calls = other.calls_from(to_other[queue[i] - 1]);
+      if (calls.size() != other_calls.size()) {
+        return false;
+      }
+      for (size_t c = 0; c < calls.size(); c++) {
+        if (calls[c]->callee != other_calls[c]->callee) {
+          return false;
+        }
+        edges.push_back({Node_T::Key_T::eof(), calls[c]->to});
+        other_edges.push_back({Node_T::Key_T::eof(), other_calls[c]->to});
+      }
+
+      for (size_t e = 0; e < edges.size(); e++) {
+        auto const to       = edges[e].to;
+        auto const other_to = other_edges[e].to;
+        if (!(edges[e].key == other_edges[e].key)) {
+          return false;
+        }
+        if (!to_other[to - 1] && !from_other[other_to - 1]) {
+          to_other[to - 1]         = other_to;
+          from_other[other_to - 1] = to;
+          queue.push_back(to);
+        } else if (to_other[to - 1] != other_to || from_other[other_to - 1] != to) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+
+protected:
+  ///
+  /// Run a single optimization pass, wrapped in tracepoints
+  ///
+  template <typename Pass_T> void traced_pass(char const* name, Pass_T pass) {
+    RB_PROBE2(pass__start, name, m_nodes.size());
+    pass();
+    RB_PROBE2(pass__done, name, m_nodes.size());
+  }
+
+  ///
+  /// Traverses the entire node chain and converts any transitions to null nodes into
+  /// null transitions, this nullification bubbles up
+  /// all the way to the root
+  ///
+  void nullify_nullrefs() {
+    std::vector<bool> nulls(m_nodes.size(), false);
+
+    size_t i = 0;
+    for (Node_T& n : m_nodes) {
+      if (is_deletable_node(i + 1)) {
+        nulls[i] = true;
+      }
+      i++;
+    }
+
+
+    while (true) {
+      bool has_nulled = false;
 
       for (Node_T& n : m_nodes) {
         if (nulls[node_index(n) - 1]) {
@@ -894,13 +1577,19 @@ protected:
     for (auto c : construction_state.cursors) {
       cursors[c - 1] = true;
     }
+    // nodes at either end of a call edge keep their identity
+    std::vector<bool> calling(m_nodes.size(), false);
+    for (auto const& call : m_calls) {
+      calling[call.from - 1] = true;
+      calling[call.to - 1]   = true;
+    }
     // reverse iterate over every node excluding the root
     for (auto noderef = m_nodes.rbegin(); noderef < m_nodes.rend() - 1; noderef++) {
 
       Node_T& node  = *noderef;
       auto node_idx = node_index(node);
       // skip pure nulls (nulls without cursors on them)
-      if (node.is_null() && !cursors[node_idx - 1]) {
+      if ((node.is_null() && !cursors[node_idx - 1]) || calling[node_idx - 1]) {
         continue;
       }
 
@@ -910,7 +1599,7 @@ protected:
       std::for_each(m_nodes.begin() + 1, noderef.base() - 1, [&](Node_T& other) {
         auto other_idx = node_index(other);
 
-        if (other.is_null() && !cursors[other_idx - 1]) {
+        if ((other.is_null() && !cursors[other_idx - 1]) || calling[other_idx - 1]) {
           return;
         }
 
@@ -943,6 +1632,13 @@ protected:
             equal = false;
           }
         });
+
+        // the comparison must hold both ways, the other node may not have any transitions the node lacks
+        other.each_transition([&](auto k, auto&) {
+          if (node.transition(k) == 0) {
+            equal = false;
+          }
+        });
         if (equal) {
           matchers.push_back(other_idx);
         } else {
@@ -990,9 +1686,9 @@ protected:
 
     while (true) {
       bool has_expanded = false;
-      for (Node_T& n : m_nodes) {
+      for (Node_T const& n : std::as_const(m_nodes)) {
         if (reachables[node_index(n) - 1]) {
-          n.each_transition([&](auto k, auto& t) {
+          n.each_transition([&](auto k, size_t t) {
             const size_t corrected_transition = t - 1;
             if (reachables[corrected_transition]) {
               return;
@@ -1002,18 +1698,24 @@ protected:
           });
         }
       }
+      for (auto const& call : m_calls) {
+        if (reachables[call.from - 1] && !reachables[call.to - 1]) {
+          reachables[call.to - 1] = true;
+          has_expanded            = true;
+        }
+      }
       if (!has_expanded) {
         break;
       }
     }
 
     for (auto& c : construction_state.cursors) {
-      if (!reachables[c]) {
+      if (!reachables[c - 1]) {
         c = 0;
       }
     }
     for (auto i = 0; i < m_nodes.size(); i++) {
-      if (!reachables[i]) {
+      if (!reachables[i] && !read_node(i + 1).is_null()) {
         m_nodes[i].nullify();
       }
     }
@@ -1039,7 +1741,7 @@ protected:
     for (auto& node : m_nodes) {
 
       // If the node is null. we do not keep it, the exception is the root node and any nodes with cursors
-      if (node.is_null() && node_index(node) != 1 && !has_cursor(idx)) {
+      if (node.is_null() && node_index(node) != 1 && !has_cursor(idx) && !has_call_edge(node_index(node))) {
         continue;
       }
       new_nodes.push(node);
@@ -1064,7 +1766,342 @@ protected:
       new_cursors.push_back(mapped);
     }
     construction_state.cursors = new_cursors;
-    m_nodes                    = new_nodes;
+    remap_calls(mappings);
+    m_nodes = new_nodes;
+  }
+
+  ///
+  /// Rebuild the node store in the given order, 'order' lists every existing node id
+  /// once, with the node that should become #1 first
+  ///
+  void reorder_nodes(std::vector<size_t> const& order)
+    requires IS_DYNAMIC
+  {
+    MUTILS_ASSERT_EQ(order.size(), m_nodes.size(), "A node ordering must contain every node exactly once");
+    MUTILS_ASSERT_EQ(order[0], 1, "The root node must remain the first node");
+
+    StateMachineNodeStore<Node_T, 0> new_nodes;
+    std::vector<size_t> mappings(m_nodes.size(), 0);
+    for (auto old_idx : order) {
+      new_nodes.push(get_node(old_idx));
+      mappings[old_idx - 1] = new_nodes.size();
+    }
+
+    for (Node_T& n : new_nodes) {
+      n.each_transition([&](auto key, auto& t) {
+        t = mappings[t - 1];
+      });
+    }
+
+    for (auto& c : construction_state.cursors) {
+      c = mappings[c - 1];
+    }
+    remap_calls(mappings);
+    m_nodes = new_nodes;
+  }
+
+  ///
+  /// Encode a single transition value as the keys it is stored under
+  /// utf8 characters are split into one key per byte
+  ///
+  std::vector<typename Node_T::Key_T> encode_keys(Transition_T choice) {
+    std::vector<typename Node_T::Key_T> keys;
+    if constexpr (IS_UTF8) {
+
+      constexpr char32_t byte = 0xFF;
+      // constexpr char32_t byte_msb = 128;
+
+      // constexpr char32_t byte_dropbit = byte_msb >> 1;
+      constexpr char32_t drop_mask = 0b10111111;
+
+
+      char32_t key = choice;
+      // the key is treated as an array of 4 utf8 bytes
+
+      if (key & (byte << 24)) {
+        // 4-wide utf8 char
+        keys.push_back(Node_T::Key_T::value((key >> 24) & drop_mask));
+        keys.push_back(Node_T::Key_T::value((key >> 16) & drop_mask));
+        keys.push_back(Node_T::Key_T::value((key >> 8) & drop_mask));
+        keys.push_back(Node_T::Key_T::value(key & drop_mask));
+
+      } else if (key & (byte << 16)) {
+        // 3-wide utf8 char
+        keys.push_back(Node_T::Key_T::value((key >> 16) & drop_mask));
+        keys.push_back(Node_T::Key_T::value((key >> 8) & drop_mask));
+        keys.push_back(Node_T::Key_T::value(key & drop_mask));
+      } else if (key & (byte << 8)) {
+        // 2-wide utf8 char
+        keys.push_back(Node_T::Key_T::value((key >> 8) & drop_mask));
+        keys.push_back(Node_T::Key_T::value(key & drop_mask));
+      } else {
+        // 1-wide utf8 char  / treat as regular ascii character
+        MUTILS_ASSERT((key & 128) == 0, "The MSB was found to be set in an ascii character");
+        keys.push_back(Node_T::Key_T::value(key));
+      }
+    } else {
+      keys.push_back(Node_T::Key_T::value(choice));
+    }
+    return keys;
+  }
+
+  std::vector<typename Node_T::Key_T> encode_sequence(std::vector<Transition_T> const& seq) {
+    std::vector<typename Node_T::Key_T> keys;
+    for (auto part : seq) {
+      for (auto key : encode_keys(part)) {
+        keys.push_back(key);
+      }
+    }
+    return keys;
+  }
+
+  ////////////////////////////////////////////////////
+  /// INCREMENTAL UPDATES
+  ///
+  /// every node off the updated path is kept in a register keyed by its state hash,
+  /// a node on the path is re-registered once it is final, or replaced by an equivalent
+  /// registered node, which keeps the machine minimal without rescanning it
+  ////////////////////////////////////////////////////
+
+  IncrementalIndex& incremental_index()
+    requires IS_DYNAMIC
+  {
+    MUTILS_ASSERT(m_calls.empty(), "Machines with call edges cannot be updated incrementally, see match_call()");
+    auto& index = construction_state.index;
+    if (index.has_value()) {
+      return index.value();
+    }
+
+    // orphans would hold references that are never released
+    construction_state.cursors = {};
+    nullify_orphans();
+    construction_state.cursors = {1};
+
+    index.emplace();
+    index->in_degree.assign(m_nodes.size(), 0);
+    for (Node_T const& n : std::as_const(m_nodes)) {
+      n.each_transition([&](auto k, size_t t) {
+        index->in_degree[t - 1]++;
+      });
+    }
+    for (size_t id = 2; id <= m_nodes.size(); id++) {
+      if (index->in_degree[id - 1] == 0) {
+        index->free.push_back(id);
+      } else {
+        index->states.emplace(state_hash(id), id);
+      }
+    }
+    return index.value();
+  }
+
+  size_t state_hash(size_t id) const {
+    auto const& node = read_node(id);
+    size_t h         = node.value.has_value() ? node.value->back_by * 31 + 1 : 0;
+    node.each_transition([&](auto k, size_t t) {
+      h = (h * 1000003) ^ (k.hash() * 31 + t);
+    });
+    return h;
+  }
+
+  ///
+  /// Two states are equivalent if they hold the same value and transition to the same states
+  ///
+  bool same_state(size_t a, size_t b) const {
+    auto const& x = read_node(a);
+    auto const& y = read_node(b);
+    if (x.value != y.value) {
+      return false;
+    }
+
+    // transitions are visited in key order, so equal states visit identical sequences
+    std::vector<std::pair<typename Node_T::Key_T, size_t>> transitions;
+    x.each_transition([&](auto k, size_t t) {
+      transitions.push_back({k, t});
+    });
+    size_t i   = 0;
+    bool equal = true;
+    y.each_transition([&](auto k, size_t t) {
+      equal = equal && i < transitions.size() && transitions[i].first == k && transitions[i].second == t;
+      i++;
+    });
+    return equal && i == transitions.size();
+  }
+
+  void unregister_state(IncrementalIndex& index, size_t id) {
+    auto [begin, end] = index.states.equal_range(state_hash(id));
+    for (auto it = begin; it != end; it++) {
+      if (it->second == id) {
+        index.states.erase(it);
+        return;
+      }
+    }
+  }
+
+  size_t allocate_state(IncrementalIndex& index) {
+    if (index.free.size()) {
+      auto const id = index.free.back();
+      index.free.pop_back();
+      return id;
+    }
+    m_nodes.push(Node_T());
+    index.in_degree.push_back(0);
+    return m_nodes.size();
+  }
+
+  void release_state(IncrementalIndex& index, size_t id) {
+    MUTILS_ASSERT_EQ(index.in_degree[id - 1], 0, "Attempt to release a node which is still referenced");
+    get_node(id).each_transition([&](auto k, auto& t) {
+      index.in_degree[t - 1]--;
+    });
+    get_node(id).nullify();
+    index.free.push_back(id);
+  }
+
+  void retarget(IncrementalIndex& index, size_t from, typename Node_T::Key_T key, size_t to) {
+    auto& transition = get_node(from).transition(key);
+    if (transition) {
+      index.in_degree[transition - 1]--;
+    }
+    transition = to;
+    if (to) {
+      index.in_degree[to - 1]++;
+    }
+  }
+
+  ///
+  /// Walk 'keys' from the root for as long as the machine allows, making every state on the
+  /// walked path exclusive to it
+  ///
+  /// returns the path, starting at the root. None of its states are registered, they must
+  /// be handed to minimize_path() once modified
+  ///
+  std::vector<size_t> unshare_path(IncrementalIndex& index, std::vector<typename Node_T::Key_T> const& keys) {
+    std::vector<size_t> path = {1};
+    bool shared              = false;
+    for (auto key : keys) {
+      MUTILS_ASSERT_EQ(get_node(path.back()).def(), 0, "Incremental updates do not support default transitions");
+      auto next = get_node(path.back()).transition(key);
+      if (next == 0) {
+        break;
+      }
+
+      // once a state is reachable by another path, every state after it must be cloned
+      shared = shared || index.in_degree[next - 1] > 1;
+      if (shared) {
+        auto const clone = allocate_state(index);
+        get_node(clone)  = get_node(next);
+        get_node(clone).each_transition([&](auto k, auto& t) {
+          index.in_degree[t - 1]++;
+        });
+        retarget(index, path.back(), key, clone);
+        next = clone;
+      } else {
+        unregister_state(index, next);
+      }
+      path.push_back(next);
+    }
+    return path;
+  }
+
+  ///
+  /// Register the states of an updated path bottom-up, replacing each state with an equivalent
+  /// registered state where one exists
+  ///
+  void minimize_path(IncrementalIndex& index,
+                     std::vector<size_t> const& path,
+                     std::vector<typename Node_T::Key_T> const& keys) {
+    for (size_t i = path.size() - 1; i > 0; i--) {
+      auto const id         = path[i];
+      auto const hash       = state_hash(id);
+      auto [begin, end]     = index.states.equal_range(hash);
+      auto const equivalent = std::find_if(begin, end, [&](auto const& entry) {
+        return same_state(entry.second, id);
+      });
+
+      if (equivalent != end) {
+        retarget(index, path[i - 1], keys[i - 1], equivalent->second);
+        release_state(index, id);
+      } else {
+        index.states.emplace(hash, id);
+      }
+    }
+  }
+
+  ///
+  /// Re-minimize the machine after the given states were modified in place
+  ///
+  /// each state is compared against the register, and merged into an equivalent state if there is one.
+  /// A merge modifies the predecessors of the merged state, so they are re-examined in turn.
+  /// 'predecessors' holds the states transitioning into every state, it may hold stale entries
+  ///
+  void minimize_from(IncrementalIndex& index,
+                     std::vector<size_t> worklist,
+                     std::vector<std::vector<size_t>>& predecessors) {
+    while (worklist.size()) {
+      auto const id = worklist.back();
+      worklist.pop_back();
+      if (id == 1 || index.in_degree[id - 1] == 0) {
+        // the root is never merged, and released states are gone
+        continue;
+      }
+
+      unregister_state(index, id);
+      auto const hash       = state_hash(id);
+      auto [begin, end]     = index.states.equal_range(hash);
+      auto const equivalent = std::find_if(begin, end, [&](auto const& entry) {
+        return same_state(entry.second, id);
+      });
+      if (equivalent == end) {
+        index.states.emplace(hash, id);
+        continue;
+      }
+
+      auto const target = equivalent->second;
+      for (auto pred : predecessors[id - 1]) {
+        if (read_node(pred).is_null()) {
+          continue;
+        }
+        unregister_state(index, pred);
+        get_node(pred).each_transition([&](auto k, auto& t) {
+          if (t == id) {
+            t = target;
+            index.in_degree[id - 1]--;
+            index.in_degree[target - 1]++;
+          }
+        });
+        predecessors[target - 1].push_back(pred);
+        worklist.push_back(pred);
+      }
+      release_state(index, id);
+    }
+  }
+
+  void insert_keys(std::vector<typename Node_T::Key_T> const& keys, typename Node_T::Value_T value) {
+    auto& index = incremental_index();
+    auto path   = unshare_path(index, keys);
+    while (path.size() <= keys.size()) {
+      auto const next = allocate_state(index);
+      retarget(index, path.back(), keys[path.size() - 1], next);
+      path.push_back(next);
+    }
+
+    auto& node = get_node(path.back());
+    if (node.value.has_value() && node.value.value() != value) {
+      switch (construction_state.on_conflict) {
+        case ConflictAction::Skip: break;
+        case ConflictAction::Overwrite: node.value = value; break;
+        case ConflictAction::Error: {
+          mutils::PANIC("An error was encountered while inserting a sequence into a state machine\n"
+                        "The sequence already leads to an exit point with a different value\n\n"
+                        "To solve this error, either make non-ambiguous state machines, or update the conflict "
+                        "behavior");
+        }
+      }
+    } else {
+      node.value = value;
+    }
+
+    minimize_path(index, path, keys);
   }
 
   //
@@ -1122,12 +2159,8 @@ protected:
     return m_nodes[m_nodes.size() - 1];
   }
 
-  std::size_t node_index(Node_T& node) const {
-    auto const addr      = &node;
-    auto const base_addr = &m_nodes[0];
-    auto const diff      = addr - base_addr;
-
-    return diff + 1;
+  std::size_t node_index(Node_T const& node) const {
+    return m_nodes.indexof(node) + 1;
   }
 
   Node_T& get_node(size_t index) {
@@ -1136,6 +2169,15 @@ protected:
     return m_nodes[index - 1];
   }
 
+  ///
+  /// Read-only node access, which (unlike get_node) never copies a shared node page
+  ///
+  Node_T const& read_node(size_t index) const {
+    MUTILS_ASSERT_LTE(index, m_nodes.size(), "Attempt to read_node outside of node storage");
+    MUTILS_ASSERT_NEQ(index, 0, "Attempt to read_node of a null reference");
+    return std::as_const(m_nodes)[index - 1];
+  }
+
   bool has_cursor(size_t index) const {
     for (auto c : construction_state.cursors) {
       if (c == index) {
@@ -1153,24 +2195,341 @@ protected:
     if (!n.is_null()) {
       return false;
     }
-    if (has_cursor(index)) {
+    if (has_cursor(index) || has_call_edge(index)) {
       return false;
     }
     return true;
   }
 
+  ///
+  /// The call edges leaving a node, ordered by the sub-machine they call
+  ///
+  std::vector<CallEdge const*> calls_from(size_t index) const {
+    std::vector<CallEdge const*> calls;
+    for (auto const& call : m_calls) {
+      if (call.from == index) {
+        calls.push_back(&call);
+      }
+    }
+    std::stable_sort(calls.begin(), calls.end(), [](CallEdge const* a, CallEdge const* b) {
+      return std::less<>()(a->callee.get(), b->callee.get());
+    });
+    return calls;
+  }
+
+  bool has_call_edge(size_t index) const {
+    return std::any_of(m_calls.begin(), m_calls.end(), [&](CallEdge const& call) {
+      return call.from == index || call.to == index;
+    });
+  }
+
+  struct CallFrame {
+    MutableRegex const* machine; // null for this machine
+    size_t node;
+    auto operator<=>(CallFrame const&) const = default;
+  };
+
+  ///
+  /// A state (of this machine or of a sub-machine) along with the states to return to
+  ///
+  /// the return stack is held inline, so following a call never allocates
+  ///
+  struct CallConfig {
+    MutableRegex const* machine = nullptr; // null for this machine
+    size_t node                 = 1;
+    size_t depth                = 0;
+    std::array<CallFrame, MAX_CALL_DEPTH> stack{};
+
+    bool operator==(CallConfig const& other) const {
+      return machine == other.machine && node == other.node && depth == other.depth &&
+             std::equal(stack.begin(), stack.begin() + depth, other.stack.begin());
+    }
+  };
+
+  ///
+  /// The node reached from a node of this machine or of a sub-machine, by 'transition_of(node)'
+  ///
+  template <typename Transition_Fn>
+  size_t call_step(MutableRegex const* machine, size_t node, Transition_Fn&& transition_of) const {
+    return machine ? transition_of(machine->read_node(node)) : transition_of(read_node(node));
+  }
+
+  template <typename Config_T, typename Callback_T> void each_call(Config_T const& config, Callback_T&& on_call) const {
+    auto const follow = [&](auto const& calls) {
+      for (auto const& call : calls) {
+        if (call.from == config.node) {
+          on_call(call);
+        }
+      }
+    };
+    config.machine ? follow(config.machine->m_calls) : follow(m_calls);
+  }
+
+  template <typename Config_T> bool call_accepts(Config_T const& config) const {
+    return config.machine ? config.machine->read_node(config.node).value.has_value()
+                          : read_node(config.node).value.has_value();
+  }
+
+  ///
+  /// Add every configuration reachable from 'configs' through calls and returns
+  ///
+  void close_calls(std::vector<CallConfig>& configs) const {
+    auto const add = [&](CallConfig const& next) {
+      if (std::find(configs.begin(), configs.end(), next) == configs.end()) {
+        configs.push_back(next);
+      }
+    };
+    for (size_t i = 0; i < configs.size(); i++) {
+      auto const config = configs[i]; // 'configs' may grow
+      if (config.depth < MAX_CALL_DEPTH) {
+        each_call(config, [&](auto const& call) {
+          auto next                 = config;
+          next.stack[next.depth++] = {config.machine, call.to};
+          next.machine             = call.callee ? call.callee.get() : config.machine;
+          next.node                = 1;
+          add(next);
+        });
+      }
+      if (config.depth && call_accepts(config)) {
+        auto next    = config;
+        auto frame   = next.stack[--next.depth];
+        next.machine = frame.machine;
+        next.node    = frame.node;
+        add(next);
+      }
+    }
+  }
+
+  ///
+  /// matches() for machines with call edges
+  ///
+  /// the machine is run as a pushdown automaton, from a single configuration (see CallConfig). Where calls and
+  /// returns leave only one configuration which can take the next transition, it is simply followed, so a
+  /// machine whose calls are unambiguous is run deterministically. Only where several configurations survive a
+  /// transition does matching fall back to following all of them at once (see matches_with_ambiguous_calls())
+  ///
+  template <bool const INCLUDE_EOF> match_result matches_with_calls(std::span<input_t> input) const {
+#define err(msg)                                                                                                       \
+  if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
+  else return {msg};
+    constexpr auto null_val = [&]() {
+      if constexpr (IS_REGEX) {
+        return false;
+      } else {
+        return static_cast<Value_T const*>(nullptr);
+      }
+    }();
+
+    CallConfig current;
+    std::vector<CallConfig> reachable;
+    std::vector<CallConfig> stepped;
+    utf_validator uv;
+    for (size_t i = 0; i < input.size(); i++) {
+      auto const transition = input[i];
+      if constexpr (IS_UTF8) {
+        auto error = uv.next(transition);
+        if (error != utf_validator::None) {
+          err(utf_validator::err_to_msg(error));
+        }
+      }
+
+      bool has_call = false;
+      each_call(current, [&](auto const&) { has_call = true; });
+      if (!has_call && !(current.depth && call_accepts(current))) {
+        current.node = call_step(current.machine, current.node, [&](auto const& node) {
+          return node.rt_get_transition(transition);
+        });
+        if (!current.node) {
+          return null_val;
+        }
+        continue;
+      }
+
+      reachable.assign(1, current);
+      close_calls(reachable);
+      stepped.clear();
+      for (auto config : reachable) {
+        config.node = call_step(config.machine, config.node, [&](auto const& node) {
+          return node.rt_get_transition(transition);
+        });
+        if (config.node && std::find(stepped.begin(), stepped.end(), config) == stepped.end()) {
+          stepped.push_back(config);
+        }
+      }
+      if (stepped.empty()) {
+        return null_val;
+      }
+      if (stepped.size() > 1) {
+        return matches_with_ambiguous_calls<INCLUDE_EOF>(stepped, input.subspan(i + 1), uv);
+      }
+      current = stepped[0];
+    }
+    if constexpr (IS_UTF8) {
+      auto error = uv.final();
+      if (error != utf_validator::None) {
+        err(utf_validator::err_to_msg(error));
+      }
+    }
+
+    reachable.assign(1, current);
+    close_calls(reachable);
+    if constexpr (INCLUDE_EOF) {
+      stepped.clear();
+      for (auto config : reachable) {
+        config.node = call_step(config.machine, config.node, [](auto const& node) { return node.get_eof(); });
+        if (config.node && std::find(stepped.begin(), stepped.end(), config) == stepped.end()) {
+          stepped.push_back(config);
+        }
+      }
+      close_calls(stepped);
+      reachable = stepped;
+    }
+
+    for (auto const& config : reachable) {
+      if (config.depth || !read_node(config.node).value.has_value()) {
+        continue;
+      }
+      if constexpr (IS_REGEX) {
+        return true;
+      } else {
+        return &read_node(config.node).value.value().value;
+      }
+    }
+    return null_val;
+#undef err
+  }
+
+  ///
+  /// matches_with_calls(), continued from several configurations at once
+  ///
+  /// every configuration reachable through calls and returns is followed at once, so calls never need to
+  /// backtrack
+  ///
+  template <bool const INCLUDE_EOF>
+  match_result matches_with_ambiguous_calls(std::vector<CallConfig> const& from,
+                                            std::span<input_t> input,
+                                            utf_validator uv) const {
+#define err(msg)                                                                                                       \
+  if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
+  else return {msg};
+    constexpr auto null_val = [&]() {
+      if constexpr (IS_REGEX) {
+        return false;
+      } else {
+        return static_cast<Value_T const*>(nullptr);
+      }
+    }();
+
+    struct Config {
+      MutableRegex const* machine; // null for this machine
+      size_t node;
+      std::vector<CallFrame> stack;
+      auto operator<=>(Config const&) const = default;
+    };
+
+    auto const step = [&](std::set<Config> const& configs, auto&& transition_of) {
+      std::set<Config> next;
+      for (auto const& config : configs) {
+        if (auto const to = call_step(config.machine, config.node, transition_of)) {
+          next.insert({config.machine, to, config.stack});
+        }
+      }
+      return next;
+    };
+
+    // add every configuration reachable through calls and returns
+    auto const close = [&](std::set<Config>& configs) {
+      std::vector<Config> pending(configs.begin(), configs.end());
+      while (!pending.empty()) {
+        auto const config = std::move(pending.back());
+        pending.pop_back();
+        auto const add = [&](Config next) {
+          if (configs.insert(next).second) {
+            pending.push_back(std::move(next));
+          }
+        };
+
+        if (config.stack.size() < MAX_CALL_DEPTH) {
+          each_call(config, [&](auto const& call) {
+            Config next{call.callee ? call.callee.get() : config.machine, 1, config.stack};
+            next.stack.push_back({config.machine, call.to});
+            add(std::move(next));
+          });
+        }
+        if (!config.stack.empty() && call_accepts(config)) {
+          Config next{config.stack.back().machine, config.stack.back().node, config.stack};
+          next.stack.pop_back();
+          add(std::move(next));
+        }
+      }
+    };
+
+    std::set<Config> current;
+    for (auto const& config : from) {
+      current.insert({config.machine, config.node, {config.stack.begin(), config.stack.begin() + config.depth}});
+    }
+    for (auto transition : input) {
+      if constexpr (IS_UTF8) {
+        auto error = uv.next(transition);
+        if (error != utf_validator::None) {
+          err(utf_validator::err_to_msg(error));
+        }
+      }
+      close(current);
+      current = step(current, [&](auto const& node) { return node.rt_get_transition(transition); });
+      if (current.empty()) {
+        return null_val;
+      }
+    }
+    if constexpr (IS_UTF8) {
+      auto error = uv.final();
+      if (error != utf_validator::None) {
+        err(utf_validator::err_to_msg(error));
+      }
+    }
+    close(current);
+    if constexpr (INCLUDE_EOF) {
+      current = step(current, [](auto const& node) { return node.get_eof(); });
+      close(current);
+    }
+
+    for (auto const& config : current) {
+      if (!config.stack.empty() || !read_node(config.node).value.has_value()) {
+        continue;
+      }
+      if constexpr (IS_REGEX) {
+        return true;
+      } else {
+        return &read_node(config.node).value.value().value;
+      }
+    }
+    return null_val;
+#undef err
+  }
+
+  ///
+  /// Move the call edges onto renumbered nodes, 'mappings' holds the new id of every old id
+  ///
+  void remap_calls(std::vector<size_t> const& mappings) {
+    for (auto& call : m_calls) {
+      call.from = mappings[call.from - 1];
+      call.to   = mappings[call.to - 1];
+    }
+  }
+
   struct ConsumeResult {
     std::map<size_t, size_t> mappings;
     std::vector<size_t> terminals;
   };
 
-  ConsumeResult consume_regex_except_root(MutableRegex regex) {
+  ConsumeResult consume_regex_except_root(MutableRegex const& regex) {
     std::map<size_t, size_t> mappings;
 
     std::vector<size_t> terminals;
 
     size_t const base_index = m_nodes.size() - 1;
-    for (auto node = regex.m_nodes.begin() + 1; node < regex.m_nodes.end(); node++) {
+    auto const& nodes = std::as_const(regex.m_nodes);
+    for (auto node = nodes.begin() + 1; node < nodes.end(); node++) {
       auto idx = regex.node_index(*node);
 
       if (node->value.has_value()) {
@@ -1180,7 +2539,7 @@ protected:
 
       Node_T n;
       // Update indexes for the new indexing system
-      node->each_transition([&](auto k, auto& v) {
+      node->each_transition([&](auto k, size_t v) {
         n.transition(k) = v + base_index;
       });
 
@@ -1195,9 +2554,10 @@ protected:
     return r;
   }
 
-  void merge_regex_into_machine(MutableRegex regex)
+  void merge_regex_into_machine(MutableRegex const& regex)
     requires IS_DYNAMIC
   {
+    RB_PROBE2(merge__start, m_nodes.size(), regex.m_nodes.size());
     auto const base_idx = m_nodes.size() - 1;
     auto result         = consume_regex_except_root(regex);
     auto terminals      = result.terminals;
@@ -1205,7 +2565,7 @@ protected:
     Node_T new_root_transitions;
 
     // Get all the regex's root transtions, normalized to the new indexes
-    regex.m_nodes[0].each_transition([&](auto transition, auto& dest) {
+    std::as_const(regex.m_nodes)[0].each_transition([&](auto transition, size_t dest) {
       new_root_transitions.transition(transition) = dest + base_idx;
     });
 
@@ -1223,6 +2583,7 @@ protected:
 
     // finally, we can update the insertion points (cursors) to be the terminals
     construction_state.cursors = terminals;
+    RB_PROBE1(merge__done, m_nodes.size());
   }
 
   // Makes an unambiguous transition, this is where the brunt of regex combination logic lives
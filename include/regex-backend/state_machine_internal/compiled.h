@@ -0,0 +1,648 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./builder.h"
+#include "./node.h"
+#include "../util/huge_pages.h"
+#include "../util/metrics.h"
+#include "../util/perfect_hash.h"
+#include "../util/probes.h"
+#include "mutils/assert.h"
+#include "mutils/panic.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// A frozen, table-driven form of a state machine, as produced by StateMachine::compile()
+///
+/// Every state owns a row of ROW_STRIDE transitions, one for each possible input byte, with the
+/// default transitions already baked in. Transitions are stored pre-multiplied by the row stride
+/// (i.e as the offset of the target row), so stepping the machine costs a single load.
+///
+/// States are laid out as [ dead | accepting... | the rest... ], with the dead state at offset 0.
+/// Any state which needs special handling within a scan (no further progress can be made, or a match
+/// has to be recorded) therefore lies at or below max_special, and a single compare tells the scanning
+/// loops when to leave the fast path.
+///
+/// Every lookup is const and lock-free, so a single compiled machine may be shared between any
+/// number of threads. attach_metrics() is the only mutator and should be called before sharing.
+///
+/// When the machine accepts only a finite set of literals (its transition graph has no cycles and no
+/// eof transitions), those literals are also placed in a minimal perfect hash table, and matches()
+/// becomes a length check, one hash and one memcmp. find() and scan() always walk the table
+///
+/// When HUGE_PAGES is set, the transition table is backed by 2MB pages (see HugePageAllocator),
+/// which greatly reduces TLB misses when scanning through very large machines
+///
+template <typename Machine_T, bool HUGE_PAGES> class CompiledStateMachine {
+public:
+  using state_t      = uint32_t;
+  using input_t      = typename Machine_T::input_t;
+  using find_result  = typename Machine_T::find_result;
+  using match_result = typename Machine_T::match_result;
+
+  constexpr static size_t ROW_STRIDE = 256;
+  constexpr static state_t DEAD      = 0;
+
+private:
+  constexpr static bool IS_UTF8                  = Machine_T::IS_UTF8;
+  constexpr static bool IS_REGEX                 = Machine_T::IS_REGEX;
+  constexpr static MatchErrorMode ON_MATCH_ERROR = Machine_T::ERROR_MODE;
+
+  using Stored_T      = typename Machine_T::Stored_T;
+  using Value_T       = Node_Value<Stored_T>;
+  using utf_validator = typename Machine_T::utf_validator;
+  using Table_T       = std::conditional_t<HUGE_PAGES,
+                                     std::vector<state_t, HugePageAllocator<state_t>>,
+                                     std::vector<state_t>>;
+
+  Table_T m_table;               // ROW_STRIDE transitions for every state
+  std::vector<state_t> m_eof;    // the eof transition of every state, indexed by state id
+  std::vector<Value_T> m_values; // the value of every accepting state, indexed by state id - 1
+  state_t m_start       = DEAD;  // the root state
+  state_t m_max_special = DEAD;  // the last accepting state
+  PerfectHashTable m_literals;   // every accepted input, to its accepting state, when there are finitely many
+  MatchMetrics* m_metrics = nullptr;
+
+  constexpr static size_t MAX_LITERALS      = 1 << 20;
+  constexpr static size_t MAX_LITERAL_BYTES = 1 << 26;
+
+public:
+  explicit CompiledStateMachine(Machine_T const& machine) {
+    auto const& nodes = machine.m_nodes;
+
+    // assign the accepting states their ids first, so they form a contiguous range
+    // directly after the dead state
+    std::vector<state_t> ids(nodes.size(), DEAD);
+    size_t next_id = 1;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (nodes[i].value.has_value()) {
+        ids[i] = next_id++;
+        m_values.push_back(nodes[i].value.value());
+      }
+    }
+    m_max_special = (next_id - 1) * ROW_STRIDE;
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (!nodes[i].value.has_value()) {
+        ids[i] = next_id++;
+      }
+    }
+    MUTILS_ASSERT_LTE(next_id,
+                      std::numeric_limits<state_t>::max() / ROW_STRIDE,
+                      "The state machine is too large to be compiled");
+
+    auto const offset_of = [&](size_t node) -> state_t {
+      return node ? ids[node - 1] * ROW_STRIDE : DEAD;
+    };
+
+    m_table.assign(next_id * ROW_STRIDE, DEAD);
+    m_eof.assign(next_id, DEAD);
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto const row = ids[i] * ROW_STRIDE;
+      for (size_t c = 0; c < ROW_STRIDE; c++) {
+        m_table[row + c] = offset_of(nodes[i].byte_transition(c));
+      }
+      m_eof[ids[i]] = offset_of(nodes[i].get_eof());
+    }
+    m_start = offset_of(1);
+    build_literals();
+    RB_PROBE2(engine__select, m_literals.empty() ? "table" : "perfect_hash", size());
+  }
+
+  ///
+  /// The number of states held by the table, including the dead state
+  ///
+  size_t size() const {
+    return m_eof.size();
+  }
+
+  ///
+  /// The number of accepting states, each accepting state corresponds to one hit counter slot
+  ///
+  size_t accepting_states() const {
+    return m_values.size();
+  }
+
+  ///
+  /// The number of literals held by the perfect hash fast path of matches(),
+  /// 0 when the machine's language is infinite (or too large to enumerate)
+  ///
+  size_t literals() const {
+    return m_literals.size();
+  }
+
+  ///
+  /// Start collecting latencies and hit counts into 'metrics', or stop collecting when null
+  ///
+  /// hit counter slots correspond to accepting states, see slot_of()
+  ///
+  void attach_metrics(MatchMetrics* metrics) {
+    m_metrics = metrics;
+  }
+
+  ///
+  /// Get the hit counter slot corresponding to a value returned from a match
+  ///
+  size_t slot_of(Stored_T const* value) const
+    requires(!IS_REGEX)
+  {
+    auto const offset = reinterpret_cast<char const*>(value) - reinterpret_cast<char const*>(&m_values[0].value);
+    return offset / sizeof(Value_T);
+  }
+
+  ///
+  /// Equivalent to StateMachine::find()
+  ///
+  find_result find(std::span<input_t> input) const {
+    if (!m_metrics) {
+      state_t matched;
+      return find_state(input, matched);
+    }
+    auto const start = std::chrono::steady_clock::now();
+    state_t matched;
+    auto result = find_state(input, matched);
+    record(MatchOperation::Find, start, matched);
+    return result;
+  }
+
+  ///
+  /// Equivalent to StateMachine::matches()
+  ///
+  template <bool const INCLUDE_EOF = false> match_result matches(std::span<input_t> input) const {
+    if (!m_metrics) {
+      state_t final;
+      return matches_state<INCLUDE_EOF>(input, final);
+    }
+    auto const start = std::chrono::steady_clock::now();
+    state_t final;
+    auto result = matches_state<INCLUDE_EOF>(input, final);
+    record(MatchOperation::Matches, start, result.success() ? final : DEAD);
+    return result;
+  }
+
+  ///
+  /// The progress of a scan() suspended part way through its input, see resume()
+  ///
+  struct ScanCursor {
+    size_t position    = 0; // the next byte to be read
+    size_t match_begin = 0;
+    size_t match_end   = 0;
+    state_t current    = DEAD;
+    state_t matched    = DEAD; // the most specific accepting state of the pending match
+    utf_validator uv;
+    bool done = false;
+  };
+
+  ///
+  /// Apply find() over the entire input, calling 'on_match' with every result
+  ///
+  /// a cheaper, eager alternative to StateMachine::find_many(),
+  /// scanning stops early after an error or an empty match
+  ///
+  /// returns the number of matches made
+  ///
+  template <typename Callback_T> size_t scan(std::span<input_t> input, Callback_T&& on_match) const {
+    RB_PROBE1(scan__start, input.size());
+    auto const start = m_metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    auto cursor      = begin_scan();
+    auto const count = resume(cursor, input, input.size(), on_match);
+    if (m_metrics) {
+      record(MatchOperation::Scan, start, DEAD);
+    }
+    RB_PROBE2(scan__done, input.size(), count);
+    return count;
+  }
+
+  ///
+  /// A cursor at the start of a scan
+  ///
+  ScanCursor begin_scan() const {
+    ScanCursor cursor;
+    cursor.current = m_start;
+    return cursor;
+  }
+
+  ///
+  /// Whether 'byte' leads anywhere from the root state, i.e whether a match may begin with it
+  ///
+  bool can_start(unsigned char byte) const {
+    return m_table[m_start + byte] != DEAD;
+  }
+
+  ///
+  /// Move a cursor which is waiting at the root state forward to 'position', without reading the bytes before it
+  ///
+  /// this is only correct when none of those bytes can_start(), and does nothing for utf8 machines, where every
+  /// byte must still be validated
+  ///
+  void skip_to(ScanCursor& cursor, size_t position) const {
+    if constexpr (!IS_UTF8) {
+      if (cursor.current == m_start && cursor.matched == DEAD && cursor.position < position) {
+        cursor.position = cursor.match_begin = cursor.match_end = position;
+      }
+    }
+  }
+
+  ///
+  /// Continue a scan of 'input' until the cursor has read every byte before 'limit', calling 'on_match' with
+  /// every result (as scan() would)
+  ///
+  /// a cursor must always be resumed over the same input, and the match pending at the end of the input is
+  /// only reported once the limit reaches input.size(). A cursor may step back over up to the length of the
+  /// longest match after reporting it, so limits should be spaced well apart
+  ///
+  /// returns the number of matches made
+  ///
+  template <typename Callback_T>
+  size_t resume(ScanCursor& suspended, std::span<input_t> input, size_t limit, Callback_T&& on_match) const {
+    // the cursor is stepped as a local so it may live in registers, and is only written back around callbacks
+    auto cursor  = suspended;
+    size_t count = 0;
+    while (!cursor.done) {
+      if (cursor.position >= limit) {
+        if (limit < input.size()) {
+          break;
+        }
+        // the end of the input, report what is left as find() would
+        if constexpr (IS_UTF8) {
+          auto error = cursor.uv.final();
+          if (error != utf_validator::None) {
+            suspended = cursor;
+            fail(cursor, utf_validator::err_to_msg(error), on_match);
+            break;
+          }
+        }
+        if (cursor.matched == DEAD) {
+          cursor.done = true;
+          break;
+        }
+        count++;
+        suspended = cursor;
+        report(cursor, input, on_match);
+        continue;
+      }
+
+      auto const c = input[cursor.position];
+      if constexpr (IS_UTF8) {
+        auto error = cursor.uv.next(c);
+        if (error != utf_validator::None) {
+          fail(cursor, utf_validator::err_to_msg(error), on_match);
+          break;
+        }
+      }
+
+      auto const next = m_table[cursor.current + static_cast<unsigned char>(c)];
+
+      // fast path, an ordinary state
+      if (next > m_max_special) {
+        cursor.current = next;
+        cursor.position++;
+        continue;
+      }
+
+      if (next != DEAD) {
+        cursor.current   = next;
+        cursor.matched   = next;
+        cursor.match_end = ++cursor.position;
+      } else if (cursor.matched == DEAD) {
+        // as in find(), the byte which failed is skipped
+        cursor.current     = m_start;
+        cursor.match_begin = cursor.match_end = ++cursor.position;
+      } else {
+        count++;
+        suspended = cursor;
+        report(cursor, input, on_match);
+      }
+    }
+    suspended = cursor;
+    return count;
+  }
+
+private:
+  ///
+  /// find(), which also yields the accepting state the match ended on (or DEAD)
+  ///
+  find_result find_state(std::span<input_t> input, state_t& matched) const {
+#define err(msg)                                                                                                       \
+  if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
+  else return {msg};
+
+    matched                       = DEAD;
+    state_t current               = m_start;
+    state_t most_specific_matched = DEAD;
+    size_t match_begin            = 0;
+    size_t match_end              = 0;
+    utf_validator uv;
+    for (size_t i = 0; i < input.size(); i++) {
+      if constexpr (IS_UTF8) {
+        auto error = uv.next(input[i]);
+        if (error != utf_validator::None) {
+          err(utf_validator::err_to_msg(error));
+        }
+      }
+
+      auto const next = m_table[current + static_cast<unsigned char>(input[i])];
+
+      // fast path, an ordinary state
+      if (next > m_max_special) {
+        current = next;
+        continue;
+      }
+
+      if (next != DEAD) {
+        // an accepting state, go one iteration deeper and continue
+        current               = next;
+        most_specific_matched = next;
+        match_end             = i + 1;
+      } else if (most_specific_matched == DEAD) {
+        // reset the current state, and try to match from scratch
+        current     = m_start;
+        match_begin = i + 1;
+        match_end   = i + 1;
+      } else {
+        // we have a match, just return that
+        break;
+      }
+    }
+
+    if constexpr (IS_UTF8) {
+      auto error = uv.final();
+      if (error != utf_validator::None) {
+        err(utf_validator::err_to_msg(error));
+      }
+    }
+
+    if (most_specific_matched != DEAD) {
+      matched         = most_specific_matched;
+      auto const& val = value_of(most_specific_matched);
+      match_end -= val.back_by;
+      auto range = std::span<input_t>(input.begin() + match_begin, input.begin() + match_end);
+      if constexpr (!IS_REGEX) {
+        return find_result(range, &val.value);
+      } else {
+        return find_result(range);
+      }
+    } else {
+      if constexpr (ON_MATCH_ERROR == MatchErrorMode::Return) {
+        return find_result(nullptr);
+      } else {
+        return find_result();
+      }
+    }
+#undef err
+  }
+
+  ///
+  /// matches(), which also yields the state the match ended on
+  ///
+  template <bool const INCLUDE_EOF> match_result matches_state(std::span<input_t> input, state_t& current) const {
+#define err(msg)                                                                                                       \
+  if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) mutils::PANIC(msg);                                           \
+  else return {msg};
+    constexpr auto null_val = [&]() {
+      if constexpr (IS_REGEX) {
+        return false;
+      } else {
+        return static_cast<Stored_T const*>(nullptr);
+      }
+    }();
+
+    // the literals are only enumerated for machines without eof transitions, which never match with INCLUDE_EOF,
+    // so that case is left to the table walk
+    if (!INCLUDE_EOF && !m_literals.empty()) {
+      if (auto const state = m_literals.find(input.data(), input.size())) {
+        current = *state;
+        if constexpr (IS_REGEX) {
+          return true;
+        } else {
+          return &value_of(current).value;
+        }
+      }
+      if constexpr (!IS_UTF8) {
+        current = DEAD;
+        return null_val;
+      }
+      // malformed utf8 must still be reported, so misses fall through to the table
+    }
+
+    current = m_start;
+    utf_validator uv;
+    for (auto transition : input) {
+      current = m_table[current + static_cast<unsigned char>(transition)];
+
+      if constexpr (IS_UTF8) {
+        auto error = uv.next(transition);
+        if (error != utf_validator::None) {
+          err(utf_validator::err_to_msg(error));
+        }
+      }
+      if (current == DEAD) {
+        return null_val;
+      }
+    }
+
+    if constexpr (IS_UTF8) {
+      auto error = uv.final();
+      if (error != utf_validator::None) {
+        err(utf_validator::err_to_msg(error));
+      }
+    }
+    if constexpr (INCLUDE_EOF) {
+      // Attempt to transition via eof
+      current = m_eof[current / ROW_STRIDE];
+    }
+
+    // at this point, we validate that the current state is an accepting state
+    if (current != DEAD && current <= m_max_special) {
+      if constexpr (IS_REGEX) {
+        return true;
+      } else {
+        return &value_of(current).value;
+      }
+    } else {
+      return null_val;
+    }
+#undef err
+  }
+
+  ///
+  /// Enumerate the language of the table into m_literals, if it is finite
+  ///
+  /// a depth first search over the rows finds any cycle, and counts the accepted inputs (and their bytes)
+  /// below every state, so that oversized languages are rejected before anything is enumerated
+  ///
+  void build_literals() {
+    if (std::any_of(m_eof.begin(), m_eof.end(), [](state_t s) { return s != DEAD; })) {
+      return;
+    }
+
+    enum : uint8_t { Unvisited, Open, Closed };
+    auto const states = size();
+    std::vector<uint8_t> color(states, Unvisited);
+    std::vector<size_t> count(states, 0); // inputs accepted from each state
+    std::vector<size_t> bytes(states, 0); // the total length of those inputs
+    auto const saturate = [](size_t& total, size_t add, size_t limit) { total = std::min(total + add, limit + 1); };
+
+    std::vector<std::pair<state_t, size_t>> stack{{m_start, 0}};
+    color[m_start / ROW_STRIDE] = Open;
+    while (!stack.empty()) {
+      auto& [state, c] = stack.back();
+      auto const row   = state / ROW_STRIDE;
+      if (c == ROW_STRIDE) {
+        if (state <= m_max_special) {
+          saturate(count[row], 1, MAX_LITERALS);
+        }
+        color[row] = Closed;
+        stack.pop_back();
+        continue;
+      }
+      auto const next = m_table[state + c++];
+      if (next == DEAD) {
+        continue;
+      }
+      auto const next_row = next / ROW_STRIDE;
+      if (color[next_row] == Open) {
+        return; // a cycle, the language is infinite
+      }
+      if (color[next_row] == Unvisited) {
+        color[next_row] = Open;
+        c--; // revisit this byte once the target is closed
+        stack.emplace_back(next, 0);
+        continue;
+      }
+      saturate(count[row], count[next_row], MAX_LITERALS);
+      saturate(bytes[row], bytes[next_row] + count[next_row], MAX_LITERAL_BYTES);
+    }
+    auto const root = m_start / ROW_STRIDE;
+    if (count[root] > MAX_LITERALS || bytes[root] > MAX_LITERAL_BYTES) {
+      return;
+    }
+
+    // the language is finite and small enough, write every literal out back to back
+    std::vector<char> pool;
+    std::vector<std::pair<size_t, size_t>> spans; // offset, length in pool
+    std::vector<uint32_t> accepting;
+    pool.reserve(bytes[root]);
+    std::vector<char> path;
+    std::vector<std::pair<state_t, size_t>> walk{{m_start, 0}};
+    while (!walk.empty()) {
+      auto& [state, c] = walk.back();
+      if (c == 0 && state <= m_max_special) {
+        spans.emplace_back(pool.size(), path.size());
+        accepting.push_back(state);
+        pool.insert(pool.end(), path.begin(), path.end());
+      }
+      while (c < ROW_STRIDE && m_table[state + c] == DEAD) {
+        c++;
+      }
+      if (c == ROW_STRIDE) {
+        walk.pop_back();
+        if (!path.empty()) {
+          path.pop_back();
+        }
+        continue;
+      }
+      auto const next = m_table[state + c];
+      path.push_back(static_cast<char>(c++));
+      walk.emplace_back(next, 0);
+    }
+
+    std::vector<PerfectHashTable::Key> keys;
+    keys.reserve(spans.size());
+    for (size_t i = 0; i < spans.size(); i++) {
+      auto const data = pool.data() + spans[i].first;
+      if constexpr (IS_UTF8) {
+        // the table walk would reject malformed literals, so they cannot be answered from the hash
+        utf_validator uv;
+        for (size_t j = 0; j < spans[i].second; j++) {
+          if (uv.next(data[j]) != utf_validator::None) {
+            return;
+          }
+        }
+        if (uv.final() != utf_validator::None) {
+          return;
+        }
+      }
+      keys.push_back({.data = data, .length = spans[i].second, .payload = accepting[i]});
+    }
+    m_literals.build(keys);
+  }
+
+  ///
+  /// Hand the cursor's pending match to 'on_match', and restart the cursor where the match ends
+  ///
+  template <typename Callback_T>
+  void report(ScanCursor& cursor, std::span<input_t> input, Callback_T& on_match) const {
+    auto const& val = value_of(cursor.matched);
+    auto const end  = cursor.match_end - val.back_by;
+    auto range      = std::span<input_t>(input.begin() + cursor.match_begin, input.begin() + end);
+    if (m_metrics) {
+      m_metrics->record_hit(cursor.matched / ROW_STRIDE - 1);
+    }
+    if constexpr (!IS_REGEX) {
+      on_match(find_result(range, &val.value));
+    } else {
+      on_match(find_result(range));
+    }
+
+    if (range.size() == 0) {
+      cursor.done = true;
+      return;
+    }
+    cursor          = begin_scan();
+    cursor.position = cursor.match_begin = cursor.match_end = end;
+  }
+
+  template <typename Callback_T> void fail(ScanCursor& cursor, char const* msg, Callback_T& on_match) const {
+    cursor.done = true;
+    if constexpr (ON_MATCH_ERROR == MatchErrorMode::Panic) {
+      mutils::PANIC(msg);
+    } else {
+      on_match(find_result(msg));
+    }
+  }
+
+  void record(MatchOperation op, std::chrono::steady_clock::time_point start, state_t matched) const {
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+    m_metrics->record_latency(op, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    if (matched != DEAD) {
+      m_metrics->record_hit(matched / ROW_STRIDE - 1);
+    }
+  }
+
+  Value_T const& value_of(state_t state) const {
+    return m_values[state / ROW_STRIDE - 1];
+  }
+};
+
+}; // namespace regex_backend::internal
@@ -0,0 +1,308 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./builder.h"
+#include "mutils/assert.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// An ordered cursor over the keys of a dictionary machine (a char machine used as a string -> value map)
+///
+/// keys are visited in lexicographic (byte) order by a depth first walk of the machine itself, the current
+/// key is rebuilt in place as the walk moves, so no sorted copy of the keys is ever kept
+///
+/// the walk state and key buffer are reused between seeks, so once a cursor has grown to the depth of the
+/// longest key, moving it around allocates nothing
+///
+/// Note: the machine must accept a finite language (i.e be free of cycles), and must not be modified
+/// while the cursor is in use. Default and eof transitions are not enumerated
+///
+template <typename Machine_T> class DictionaryCursor {
+  static_assert(std::is_same_v<typename Machine_T::input_t, char> && !Machine_T::IS_UTF8,
+                "Dictionary cursors only support char machines");
+
+  using Stored_T = typename Machine_T::Stored_T;
+
+  constexpr static size_t KEYSPACE = 128; // char nodes only hold ascii transitions
+
+  struct Frame {
+    size_t node;
+    size_t next; // the next transition to try
+  };
+
+  Machine_T const* m_machine;
+  std::vector<Frame> m_stack;
+  std::vector<char> m_key;
+  bool m_valid = false;
+
+public:
+  explicit DictionaryCursor(Machine_T const& machine) : m_machine(&machine) {}
+
+  ///
+  /// Position the cursor on the first key starting with 'prefix', iteration then stops after the last such key
+  ///
+  /// returns whether any key has the prefix
+  ///
+  bool seek_prefix(std::string_view prefix) {
+    m_stack.clear();
+    m_key.clear();
+    size_t node = 1;
+    for (unsigned char c : prefix) {
+      node = c < KEYSPACE ? m_machine->read_node(node).get_transition(c) : 0;
+      if (node == 0) {
+        return m_valid = false;
+      }
+    }
+    m_key.assign(prefix.begin(), prefix.end());
+    m_stack.push_back({node, 0});
+    return m_valid = m_machine->read_node(node).value.has_value() || advance();
+  }
+
+  ///
+  /// Position the cursor on the first key which is not less than 'from', iteration then continues to the last key
+  ///
+  /// returns whether there is such a key
+  ///
+  bool seek(std::string_view from) {
+    m_stack.clear();
+    m_key.clear();
+    m_stack.push_back({1, 0});
+    for (unsigned char c : from) {
+      auto& top        = m_stack.back();
+      auto const child = c < KEYSPACE ? m_machine->read_node(top.node).get_transition(c) : 0;
+      top.next         = c + 1;
+      if (child == 0) {
+        // no key continues with 'c', so the next key is the first one past it
+        return m_valid = advance();
+      }
+      m_stack.push_back({child, 0});
+      m_key.push_back(c);
+    }
+    return m_valid = m_machine->read_node(m_stack.back().node).value.has_value() || advance();
+  }
+
+  ///
+  /// Move onto the next key, returns false once there are no more keys
+  ///
+  bool next() {
+    return m_valid = m_valid && advance();
+  }
+
+  ///
+  /// Whether the cursor is positioned on a key
+  ///
+  bool valid() const {
+    return m_valid;
+  }
+
+  ///
+  /// The current key, only valid until the cursor next moves
+  ///
+  std::string_view key() const {
+    return std::string_view(m_key.data(), m_key.size());
+  }
+
+  ///
+  /// The value of the current key
+  ///
+  Stored_T const& value() const
+    requires(!std::is_void_v<Stored_T>)
+  {
+    MUTILS_ASSERT(m_valid, "Attempt to read the value of an exhausted DictionaryCursor");
+    return m_machine->read_node(m_stack.back().node).value->value;
+  }
+
+private:
+  ///
+  /// Walk on to the next accepting state, in depth first (lexicographic) order
+  ///
+  /// keys are yielded as their node is entered, so a key is always visited before its extensions
+  ///
+  bool advance() {
+    while (!m_stack.empty()) {
+      auto& top        = m_stack.back();
+      auto const& node = m_machine->read_node(top.node);
+      while (top.next < KEYSPACE && node.get_transition(top.next) == 0) {
+        top.next++;
+      }
+      if (top.next >= KEYSPACE) {
+        m_stack.pop_back();
+        if (!m_stack.empty()) {
+          m_key.pop_back();
+        }
+        continue;
+      }
+
+      auto const c     = static_cast<unsigned char>(top.next++);
+      auto const child = node.get_transition(c);
+      MUTILS_ASSERT_LTE(m_stack.size(),
+                        m_machine->m_nodes.size(),
+                        "A cycle was found while enumerating keys, the machine's language is infinite");
+      m_stack.push_back({child, 0});
+      m_key.push_back(static_cast<char>(c));
+      if (m_machine->read_node(child).value.has_value()) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+///
+/// A key found by a fuzzy lookup, along with its edit distance from the query
+///
+template <typename Stored_T> struct FuzzyMatch {
+  std::string key;
+  Stored_T const* value;
+  size_t distance;
+};
+
+template <> struct FuzzyMatch<void> {
+  std::string key;
+  size_t distance;
+};
+
+///
+/// Typo tolerant lookups over a char machine, finding every key within a bounded (Levenshtein) edit
+/// distance of a query
+///
+/// rather than generating edit variants of the query, the machine is walked depth first alongside a lazily
+/// built Levenshtein automaton: every step of the walk extends one row of the edit distance table, and a
+/// branch is abandoned as soon as every entry of its row exceeds the bound. Keys sharing a prefix share the
+/// work for that prefix, and whole subtrees further than max_edits away are never visited
+///
+/// since every branch deeper than |query| + max_edits is abandoned, the machine may have cycles
+///
+/// the walk state is reused between lookups, so repeated lookups allocate nothing once the buffers have grown
+///
+/// Note: the machine must not be modified while a lookup runs. Default and eof transitions are not followed
+///
+template <typename Machine_T> class FuzzyLookup {
+  static_assert(std::is_same_v<typename Machine_T::input_t, char> && !Machine_T::IS_UTF8,
+                "Fuzzy lookups only support char machines");
+
+  using Stored_T = typename Machine_T::Stored_T;
+
+  constexpr static size_t KEYSPACE = 128; // char nodes only hold ascii transitions
+
+  struct Frame {
+    size_t node;
+    size_t next; // the next transition to try
+  };
+
+  Machine_T const* m_machine;
+  std::vector<Frame> m_stack;
+  std::vector<char> m_key;
+  std::vector<uint32_t> m_rows; // one row of the edit distance table per frame
+
+public:
+  explicit FuzzyLookup(Machine_T const& machine) : m_machine(&machine) {}
+
+  ///
+  /// Call 'on_match' with every key within 'max_edits' edits of 'query', in lexicographic order
+  ///
+  /// 'on_match' is called as on_match(key, value, distance), or on_match(key, distance) for regexes,
+  /// the key is only valid for the duration of the call
+  ///
+  /// returns the number of keys found
+  ///
+  template <typename Callback_T> size_t each(std::string_view query, size_t max_edits, Callback_T&& on_match) {
+    auto const width = query.size() + 1;
+    size_t count     = 0;
+
+    auto const emit = [&](size_t node, uint32_t distance) {
+      auto const& value = m_machine->read_node(node).value;
+      if (!value.has_value() || distance > max_edits) {
+        return;
+      }
+      count++;
+      auto const key = std::string_view(m_key.data(), m_key.size());
+      if constexpr (std::is_void_v<Stored_T>) {
+        on_match(key, size_t(distance));
+      } else {
+        on_match(key, value->value, size_t(distance));
+      }
+    };
+
+    m_stack.assign(1, {1, 0});
+    m_key.clear();
+    m_rows.resize(width);
+    for (size_t j = 0; j < width; j++) {
+      m_rows[j] = j;
+    }
+    emit(1, query.size());
+
+    while (!m_stack.empty()) {
+      auto& top        = m_stack.back();
+      auto const& node = m_machine->read_node(top.node);
+      while (top.next < KEYSPACE && node.get_transition(top.next) == 0) {
+        top.next++;
+      }
+      if (top.next >= KEYSPACE) {
+        m_stack.pop_back();
+        m_rows.resize(m_rows.size() - width);
+        if (!m_stack.empty()) {
+          m_key.pop_back();
+        }
+        continue;
+      }
+
+      auto const c     = static_cast<char>(top.next++);
+      auto const child = node.get_transition(c);
+
+      // extend the edit distance table by one row, for the key extended by 'c'
+      auto const depth = m_stack.size();
+      m_rows.resize((depth + 1) * width);
+      auto const* row = &m_rows[(depth - 1) * width];
+      auto* next      = &m_rows[depth * width];
+      next[0]         = row[0] + 1;
+      auto best       = next[0];
+      for (size_t j = 1; j < width; j++) {
+        next[j] = std::min({row[j] + 1, next[j - 1] + 1, row[j - 1] + (query[j - 1] != c)});
+        best    = std::min(best, next[j]);
+      }
+      if (best > max_edits) {
+        // no extension of this key can come back within the bound
+        m_rows.resize(depth * width);
+        continue;
+      }
+
+      m_stack.push_back({child, 0});
+      m_key.push_back(c);
+      emit(child, next[width - 1]);
+    }
+    return count;
+  }
+};
+
+}; // namespace regex_backend::internal
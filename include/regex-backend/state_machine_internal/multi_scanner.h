@@ -0,0 +1,148 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+
+#pragma once
+
+#include "./builder.h"
+#include "./compiled.h"
+#include "../util/probes.h"
+#include "mutils/assert.h"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// Scans any number of independent compiled machines over the same input in a single pass
+///
+/// the input is walked once, a block of BLOCK_SIZE bytes at a time, and every machine is advanced over a block
+/// in turn while the block is still in cache. Each block is first searched once for the bytes which any of the
+/// machines can start a match with, and machines waiting at their root skip straight to the next of those,
+/// so long stretches which none of the machines care about are only read once
+///
+/// every machine scans as scan() would over it alone. Their results are tagged with the id returned from add(),
+/// and are merged, so they are delivered block by block, ordered by where they begin
+///
+/// Note: the machines must outlive the scanner
+///
+template <typename Machine_T, bool HUGE_PAGES = false> class MultiScanner {
+public:
+  using Compiled_T  = decltype(std::declval<Machine_T const&>().template compile<HUGE_PAGES>());
+  using input_t     = typename Compiled_T::input_t;
+  using find_result = typename Compiled_T::find_result;
+
+  constexpr static size_t BLOCK_SIZE  = 4096;
+  constexpr static size_t SKIP_STRIDE = 64;
+
+private:
+  std::vector<Compiled_T const*> m_machines;
+  std::array<bool, 256> m_starts{}; // the bytes which any machine can start a match with
+
+public:
+  ///
+  /// Add a machine to the scan, returning the id its results are tagged with
+  ///
+  size_t add(Compiled_T const& machine) {
+    m_machines.push_back(&machine);
+    for (size_t c = 0; c < m_starts.size(); c++) {
+      m_starts[c] = m_starts[c] || machine.can_start(c);
+    }
+    return m_machines.size() - 1;
+  }
+
+  size_t size() const {
+    return m_machines.size();
+  }
+
+  ///
+  /// Scan every machine over the input, calling 'on_match(id, result)' with every result
+  ///
+  /// a machine stops after an error or an empty match, the others carry on
+  ///
+  /// returns the number of matches made
+  ///
+  template <typename Callback_T> size_t scan(std::span<input_t> input, Callback_T&& on_match) const {
+    RB_PROBE1(scan__start, input.size());
+    std::vector<typename Compiled_T::ScanCursor> cursors;
+    for (auto const machine : m_machines) {
+      cursors.push_back(machine->begin_scan());
+    }
+
+    // (offset, result) for every result of the block, grouped by machine, the offset of an error is where it
+    // was found. The results of each machine are already in order, so the groups are merged rather than sorted
+    std::vector<std::pair<size_t, find_result>> pending;
+    std::vector<size_t> heads(m_machines.size()), ends(m_machines.size());
+    std::vector<size_t> next_start(BLOCK_SIZE + 1);
+    size_t count = 0;
+    size_t limit = 0;
+    do {
+      auto const block = limit;
+      limit            = std::min(limit + BLOCK_SIZE, input.size());
+
+      // the shared prefilter, where the next byte which any machine can start a match with lies
+      next_start[limit - block] = limit;
+      for (auto i = limit; i-- > block;) {
+        next_start[i - block] = m_starts[static_cast<unsigned char>(input[i])] ? i : next_start[i + 1 - block];
+      }
+
+      for (size_t id = 0; id < m_machines.size(); id++) {
+        auto const& machine = *m_machines[id];
+        auto& cursor        = cursors[id];
+        heads[id]           = pending.size();
+
+        auto const on_result = [&](find_result const& result) {
+          auto const offset = result.range.data() ? size_t(result.range.data() - input.data()) : cursor.position;
+          pending.emplace_back(offset, result);
+        };
+        // machines are stepped a cache line at a time, so any waiting at their root can skip to the next start
+        while (!cursor.done && cursor.position < limit) {
+          machine.skip_to(cursor, next_start[cursor.position - block]);
+          count += machine.resume(cursor, input, std::min(cursor.position + SKIP_STRIDE, limit), on_result);
+        }
+        ends[id] = pending.size();
+      }
+
+      for (size_t merged = 0; merged < pending.size(); merged++) {
+        size_t next = m_machines.size();
+        for (size_t id = 0; id < m_machines.size(); id++) {
+          if (heads[id] == ends[id]) {
+            continue;
+          }
+          if (next == m_machines.size() || pending[heads[id]].first < pending[heads[next]].first) {
+            next = id;
+          }
+        }
+        on_match(next, pending[heads[next]++].second);
+      }
+      pending.clear();
+    } while (limit < input.size());
+    RB_PROBE2(scan__done, input.size(), count);
+    return count;
+  }
+};
+
+}; // namespace regex_backend::internal
@@ -46,7 +46,7 @@ template <typename T> struct Node_Value {
   }
 
   bool operator!=(Node_Value const& other) const {
-    return back_by != other.back_by && value != other.value;
+    return back_by != other.back_by || value != other.value;
   }
 };
 
@@ -103,6 +103,20 @@ public:
     return k;
   }
 
+  bool operator==(TransitionKey const& other) const = default;
+
+  ///
+  /// A hash of the key, only suitable for bucketing (keys of different kinds may collide)
+  ///
+  size_t hash() const {
+    switch (kind) {
+      case Eof: return 1;
+      case Def: return 2;
+      case Val: return std::hash<Key_T>{}(val.value()) * 4 + 3;
+    }
+    return 0;
+  }
+
   operator std::string() const {
     switch (kind) {
       case Eof: return "<EOF>";
@@ -181,6 +195,22 @@ public:
     }
   }
 
+  void each_transition(std::function<void(Key_T key, size_t to)> callback) const
+    requires DYNAMIC
+  {
+    for (auto& [k, v] : transitions) {
+      if (v != 0) {
+        callback(Key_T::value(k), v);
+      }
+    }
+    if (eof_transition != 0) {
+      callback(Key_T::eof(), eof_transition);
+    }
+    if (default_transition != 0) {
+      callback(Key_T::def(), default_transition);
+    }
+  }
+
   struct TransitionInfo {
     TransitionKey<Transition_T> key;
     size_t to;
@@ -370,6 +400,22 @@ public:
     }
   }
 
+  void each_transition(std::function<void(Key_T key, size_t to)> callback) const
+    requires DYNAMIC
+  {
+    for (size_t c = 0; c < KEYSPACE_SIZE; c++) {
+      if (transitions[c] != 0) {
+        callback(Key_T::value(c), transitions[c]);
+      }
+    }
+    if (transitions[eof_idx] != 0) {
+      callback(Key_T::eof(), transitions[eof_idx]);
+    }
+    if (transitions[def_idx] != 0) {
+      callback(Key_T::def(), transitions[def_idx]);
+    }
+  }
+
   size_t& eof()
     requires DYNAMIC
   {
@@ -386,10 +432,30 @@ public:
   size_t get_transition(unsigned char c) const {
 
     ///
-    /// We can ignore the second bit, which makes the keyspace
-    /// 25% smaller.
+    /// We can ignore the second bit of utf8 bytes, which makes the keyspace
+    /// 25% smaller. ascii bytes are stored as is
     ///
-    return transitions[c & KEY_MASK];
+    return transitions[c & 0b10000000 ? c & KEY_MASK : c];
+  }
+
+  ///
+  /// Resolve the transition made on the raw input byte 'c' at runtime,
+  /// including the fallback to the default transition
+  ///
+  /// bytes outside of the keyspace of ascii nodes always take the default transition
+  ///
+  size_t byte_transition(unsigned char c) const
+    requires DYNAMIC
+  {
+    size_t idx = c;
+    if (c & 0b10000000) {
+      if constexpr (!UTF8) {
+        return transitions[def_idx];
+      }
+      idx = c & KEY_MASK;
+    }
+    auto result = transitions[idx];
+    return result ? result : transitions[def_idx];
   }
 
   size_t& def()
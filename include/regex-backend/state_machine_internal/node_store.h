@@ -22,9 +22,16 @@
 #pragma once
 
 
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <compare>
 #include <concepts>
 #include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
 #include <vector>
 #include "mutils/assert.h"
 
@@ -46,6 +53,223 @@ template <typename K_T, typename V_T> constexpr bool reasonable_expanded_allocat
   return total_size_bytes <= STORAGE_MAX_TRIVIAL_SIZE_BYTES;
 }
 
+///
+/// Growable node storage, split into fixed-size pages which are shared between copies
+///
+/// copying a store only shares its page table, and a page is copied the first time a copy accesses
+/// it mutably (copy-on-write). Machines cloned from a common base therefore only pay for the pages
+/// they diverge on
+///
+/// Note: any non-const access counts as a write, read through a const store to keep pages shared
+///
+/// the page table also holds a flat view of the data of every page, which the store caches a pointer
+/// to, so a const read costs two loads (as in a vector of pages) and a copy still shares everything
+///
+template <typename Value_T> class PagedNodeStore {
+  constexpr static size_t PAGE_SIZE = 16;
+
+  using Page_T = std::vector<Value_T>; // reserved to PAGE_SIZE, so elements never move
+  struct Table_T {
+    std::vector<std::shared_ptr<Page_T>> pages;
+    std::vector<Value_T*> view; // the data of every page, kept in step with 'pages'
+  };
+
+  std::shared_ptr<Table_T> m_pages; // null until the first push, and after a move
+  Value_T* const* m_view = nullptr; // m_pages->view.data(), so reads skip the shared table
+  size_t m_size          = 0;
+
+  // the page of the last indexof() lookup, which is nearly always the page of the next one
+  mutable std::atomic<size_t> m_hint = 0;
+
+  Table_T& writable_table() {
+    if (!m_pages) {
+      m_pages = std::make_shared<Table_T>();
+    } else if (m_pages.use_count() != 1) {
+      m_pages = std::make_shared<Table_T>(*m_pages);
+    }
+    return *m_pages;
+  }
+
+  Page_T& writable_page(size_t page) {
+    auto& table = writable_table();
+    auto& p     = table.pages[page];
+    if (p.use_count() != 1) {
+      auto copy = std::make_shared<Page_T>();
+      copy->reserve(PAGE_SIZE);
+      copy->assign(p->begin(), p->end());
+      p                = copy;
+      table.view[page] = copy->data();
+    }
+    m_view = table.view.data();
+    return *p;
+  }
+
+public:
+  template <typename Store_T, typename Ref_T> class Iterator {
+    Store_T* m_store     = nullptr;
+    std::ptrdiff_t m_idx = 0;
+
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type        = Value_T;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = std::remove_reference_t<Ref_T>*;
+    using reference         = Ref_T;
+
+    Iterator() = default;
+    Iterator(Store_T* store, std::ptrdiff_t idx) : m_store(store), m_idx(idx) {
+    }
+
+    reference operator*() const {
+      return (*m_store)[m_idx];
+    }
+    pointer operator->() const {
+      return &(*m_store)[m_idx];
+    }
+    reference operator[](difference_type n) const {
+      return (*m_store)[m_idx + n];
+    }
+
+    Iterator& operator++() {
+      m_idx++;
+      return *this;
+    }
+    Iterator operator++(int) {
+      auto it = *this;
+      m_idx++;
+      return it;
+    }
+    Iterator& operator--() {
+      m_idx--;
+      return *this;
+    }
+    Iterator operator--(int) {
+      auto it = *this;
+      m_idx--;
+      return it;
+    }
+    Iterator& operator+=(difference_type n) {
+      m_idx += n;
+      return *this;
+    }
+    Iterator& operator-=(difference_type n) {
+      m_idx -= n;
+      return *this;
+    }
+    Iterator operator+(difference_type n) const {
+      return Iterator(m_store, m_idx + n);
+    }
+    friend Iterator operator+(difference_type n, Iterator it) {
+      return it + n;
+    }
+    Iterator operator-(difference_type n) const {
+      return Iterator(m_store, m_idx - n);
+    }
+    difference_type operator-(Iterator const& other) const {
+      return m_idx - other.m_idx;
+    }
+
+    bool operator==(Iterator const& other) const {
+      return m_idx == other.m_idx;
+    }
+    auto operator<=>(Iterator const& other) const {
+      return m_idx <=> other.m_idx;
+    }
+  };
+
+  using iterator       = Iterator<PagedNodeStore, Value_T&>;
+  using const_iterator = Iterator<PagedNodeStore const, Value_T const&>;
+
+  PagedNodeStore() = default;
+  PagedNodeStore(PagedNodeStore const& other) : m_pages(other.m_pages), m_view(other.m_view), m_size(other.m_size) {
+  }
+  PagedNodeStore(PagedNodeStore&& other) noexcept
+      : m_pages(std::move(other.m_pages)), m_view(std::exchange(other.m_view, nullptr)),
+        m_size(std::exchange(other.m_size, 0)) {
+  }
+  PagedNodeStore& operator=(PagedNodeStore const& other) {
+    m_pages = other.m_pages;
+    m_view  = other.m_view;
+    m_size  = other.m_size;
+    return *this;
+  }
+  PagedNodeStore& operator=(PagedNodeStore&& other) noexcept {
+    m_pages = std::move(other.m_pages);
+    m_view  = std::exchange(other.m_view, nullptr);
+    m_size  = std::exchange(other.m_size, 0);
+    return *this;
+  }
+
+  size_t size() const {
+    return m_size;
+  }
+
+  void push_back(Value_T const& val) {
+    if (m_size % PAGE_SIZE == 0) {
+      auto& table = writable_table();
+      table.pages.push_back(std::make_shared<Page_T>());
+      table.pages.back()->reserve(PAGE_SIZE);
+      table.view.push_back(table.pages.back()->data());
+    }
+    writable_page(m_size / PAGE_SIZE).push_back(val);
+    m_size++;
+  }
+
+  ///
+  /// Get the index of an element held by this store
+  ///
+  size_t indexof(Value_T const& val) const {
+    MUTILS_ASSERT(m_pages != nullptr, "Attempt to get the index of an element outside of the store");
+    auto const& pages = m_pages->pages;
+    auto const within = [&](size_t page) {
+      auto const& p = *pages[page];
+      return !std::less<>{}(&val, p.data()) && std::less<>{}(&val, p.data() + p.size());
+    };
+
+    auto const hint = m_hint.load(std::memory_order_relaxed);
+    for (auto page : {hint, hint + 1}) {
+      if (page < pages.size() && within(page)) {
+        m_hint.store(page, std::memory_order_relaxed);
+        return page * PAGE_SIZE + (&val - pages[page]->data());
+      }
+    }
+    for (size_t page = 0; page < pages.size(); page++) {
+      if (within(page)) {
+        m_hint.store(page, std::memory_order_relaxed);
+        return page * PAGE_SIZE + (&val - pages[page]->data());
+      }
+    }
+    MUTILS_ASSERT(false, "Attempt to get the index of an element outside of the store");
+    return 0;
+  }
+
+  Value_T& operator[](size_t idx) {
+    return writable_page(idx / PAGE_SIZE)[idx % PAGE_SIZE];
+  }
+  Value_T const& operator[](size_t idx) const {
+    return m_view[idx / PAGE_SIZE][idx % PAGE_SIZE];
+  }
+
+  iterator begin() {
+    return iterator(this, 0);
+  }
+  iterator end() {
+    return iterator(this, m_size);
+  }
+  const_iterator begin() const {
+    return const_iterator(this, 0);
+  }
+  const_iterator end() const {
+    return const_iterator(this, m_size);
+  }
+  auto rbegin() {
+    return std::reverse_iterator(end());
+  }
+  auto rend() {
+    return std::reverse_iterator(begin());
+  }
+};
+
 template<typename Value_T, size_t SIZE>
 struct storage_t{
   using type = std::array<Value_T, SIZE>;
@@ -53,7 +277,7 @@ struct storage_t{
 
 template<typename Value_T>
 struct storage_t<Value_T, 0>{
-  using type = std::vector<Value_T>;
+  using type = PagedNodeStore<Value_T>;
 };
 
 template <typename Value_T, size_t SIZE = 0> struct StateMachineNodeStore {
@@ -69,7 +293,10 @@ template <typename Value_T, size_t SIZE = 0> struct StateMachineNodeStore {
     return SIZE;
   }
 
-  size_t indexof(Value_T& val) const{
+  size_t indexof(Value_T const& val) const{
+    if constexpr(IS_DYNAMIC){
+      return store.indexof(val);
+    }
     const auto idx = &val;
     const auto start = &store[0];
 
@@ -99,6 +326,13 @@ template <typename Value_T, size_t SIZE = 0> struct StateMachineNodeStore {
     return store.end();
   }
 
+  auto begin() const{
+    return store.begin();
+  }
+  auto end() const{
+    return store.end();
+  }
+
   auto rbegin(){
     return store.rbegin();
   }
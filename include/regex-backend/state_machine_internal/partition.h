@@ -0,0 +1,124 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./algebra.h"
+#include "./builder.h"
+#include "./compiled.h"
+#include "./multi_scanner.h"
+#include "../util/probes.h"
+#include "mutils/assert.h"
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// Split a set of patterns into as few machines as possible, where no machine has more than 'state_budget' states
+///
+/// patterns are packed greedily: each one is united into the first partition which stays within the budget,
+/// and only starts a new partition when none does. Products are abandoned as soon as they outgrow the budget,
+/// so a pair of patterns which would explode together is never built. A pattern which is larger than the budget
+/// by itself is given a partition of its own
+///
+/// where patterns in a partition overlap, the value of the earlier pattern is kept
+///
+template <typename Machine_T>
+std::vector<Machine_T> partition_patterns(std::vector<Machine_T> const& patterns, size_t state_budget) {
+  std::vector<Machine_T> partitions;
+  for (auto const& pattern : patterns) {
+    MUTILS_ASSERT(!pattern.has_calls(), "Patterns with call edges cannot be partitioned, see match_call()");
+    bool placed = false;
+    for (auto& part : partitions) {
+      auto united = Product<Machine_T>::build_within(ProductOperation::Union, part, pattern, state_budget);
+      if (united.has_value()) {
+        part = std::move(united.value());
+        part.optimize();
+        placed = true;
+        break;
+      }
+    }
+    if (!placed) {
+      partitions.push_back(pattern);
+    }
+  }
+  RB_PROBE2(partition__done, patterns.size(), partitions.size());
+  return partitions;
+}
+
+///
+/// A scanner over a set of patterns which is too large to be a single machine
+///
+/// the patterns are partitioned (see partition_patterns()), and every partition is compiled, then all of the
+/// partitions are scanned together in a single pass over the input (see MultiScanner)
+///
+/// Note: every partition scans independently, like scan() over the partition alone, so matches of different
+/// partitions may overlap where a single machine would only have yielded one of them
+///
+template <typename Machine_T, bool HUGE_PAGES = false> class PartitionedScanner {
+public:
+  using Scanner_T   = MultiScanner<Machine_T, HUGE_PAGES>;
+  using Compiled_T  = typename Scanner_T::Compiled_T;
+  using input_t     = typename Compiled_T::input_t;
+  using find_result = typename Compiled_T::find_result;
+
+private:
+  std::vector<Compiled_T> m_partitions;
+  Scanner_T m_scanner; // refers into m_partitions
+
+public:
+  PartitionedScanner(std::vector<Machine_T> const& patterns, size_t state_budget) {
+    for (auto const& part : partition_patterns(patterns, state_budget)) {
+      m_partitions.push_back(part.template compile<HUGE_PAGES>());
+    }
+    for (auto const& part : m_partitions) {
+      m_scanner.add(part);
+    }
+  }
+
+  PartitionedScanner(PartitionedScanner const&)            = delete;
+  PartitionedScanner& operator=(PartitionedScanner const&) = delete;
+
+  size_t partitions() const {
+    return m_partitions.size();
+  }
+
+  Compiled_T const& get_partition(size_t index) const {
+    MUTILS_ASSERT_LT(index, m_partitions.size(), "Partition index out of range");
+    return m_partitions[index];
+  }
+
+  ///
+  /// Scan every partition over the input, calling 'on_match(partition, result)' with every result
+  ///
+  /// a partition stops after an error or an empty match, the others carry on
+  ///
+  /// returns the number of matches made
+  ///
+  template <typename Callback_T> size_t scan(std::span<input_t> input, Callback_T&& on_match) const {
+    return m_scanner.scan(input, on_match);
+  }
+};
+
+}; // namespace regex_backend::internal
@@ -0,0 +1,121 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./state_machine.h"
+#include "./util/probes.h"
+#include <atomic>
+#include <future>
+#include <memory>
+#include <span>
+#include <utility>
+
+namespace regex_backend {
+
+///
+/// A machine which is usable as soon as it is constructed, and is compiled in the background
+///
+/// tier 0: lookups run directly on the machine as it was built (no optimization or compilation)
+/// tier 1: once a background thread has optimized and compiled a copy of the machine,
+///         every following lookup runs on the compiled table
+///
+/// the switch is a single atomic pointer publish, so lookups never wait on the compilation.
+/// The tier 0 machine is kept alive for the lifetime of the TieredMachine, as results
+/// handed out before the switch may still refer to its values
+///
+/// Note: machines with call edges (see match_call()) cannot be compiled, and always stay on tier 0. So do
+/// machines whose optimization or compilation throws, which wait() reports
+///
+template <typename Machine_T, bool HUGE_PAGES = false> class TieredMachine {
+public:
+  using Compiled_T   = decltype(std::declval<Machine_T const&>().template compile<HUGE_PAGES>());
+  using input_t      = typename Machine_T::input_t;
+  using find_result  = typename Machine_T::find_result;
+  using match_result = typename Machine_T::match_result;
+
+private:
+  Machine_T const m_interpreted;
+  std::unique_ptr<Compiled_T> m_compiled_storage;
+  std::atomic<Compiled_T const*> m_compiled = nullptr;
+
+  // declared last, so the destructor waits for the compilation before anything else is destroyed
+  std::shared_future<void> m_ready;
+
+public:
+  explicit TieredMachine(Machine_T machine) : m_interpreted(std::move(machine)) {
+    if (m_interpreted.has_calls()) {
+      return;
+    }
+    m_ready = std::async(std::launch::async, [this] {
+      Machine_T optimized = m_interpreted;
+      optimized.optimize();
+      m_compiled_storage = std::make_unique<Compiled_T>(optimized.template compile<HUGE_PAGES>());
+      m_compiled.store(m_compiled_storage.get(), std::memory_order_release);
+      RB_PROBE1(tier__promote, 1);
+    }).share();
+  }
+
+  TieredMachine(TieredMachine const&)            = delete;
+  TieredMachine& operator=(TieredMachine const&) = delete;
+
+  ///
+  /// The tier lookups are currently served from
+  ///
+  size_t tier() const {
+    return compiled() ? 1 : 0;
+  }
+
+  ///
+  /// Block until the compiled tier is available, returns immediately for machines which stay on tier 0
+  ///
+  /// rethrows anything thrown while optimizing or compiling the machine, which then stays on tier 0
+  ///
+  void wait() const {
+    if (m_ready.valid()) {
+      m_ready.get();
+    }
+  }
+
+  ///
+  /// Get the compiled machine, or null if it is not yet available
+  ///
+  Compiled_T const* compiled() const {
+    return m_compiled.load(std::memory_order_acquire);
+  }
+
+  find_result find(std::span<input_t> input) const {
+    if (auto const c = compiled()) {
+      return c->find(input);
+    }
+    return m_interpreted.find(input);
+  }
+
+  template <bool const INCLUDE_EOF = false> match_result matches(std::span<input_t> input) const {
+    if (auto const c = compiled()) {
+      return c->template matches<INCLUDE_EOF>(input);
+    }
+    return m_interpreted.template matches<INCLUDE_EOF>(input);
+  }
+};
+
+}; // namespace regex_backend
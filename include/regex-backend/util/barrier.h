@@ -0,0 +1,72 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <atomic>
+
+#if defined(__linux__) && __has_include(<linux/membarrier.h>)
+#  include <linux/membarrier.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  define REGEX_BACKEND_MEMBARRIER 1
+#endif
+
+namespace regex_backend::internal {
+
+///
+/// Asymmetric memory barriers, for synchronization where one side runs far more often than the other
+///
+/// a light barrier on one thread and a heavy barrier on another order memory like a pair of seq_cst fences.
+/// On Linux the heavy barrier runs membarrier(), which executes a full barrier on every running thread of
+/// the process, so the light barrier only has to keep the compiler from reordering around it. Where
+/// membarrier is unavailable (or refused by the kernel) both are ordinary seq_cst fences
+///
+inline bool membarrier_available() {
+#if defined(REGEX_BACKEND_MEMBARRIER)
+  static bool const registered =
+      syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+  return registered;
+#else
+  return false;
+#endif
+}
+
+inline void light_barrier() {
+  if (membarrier_available()) {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+inline void heavy_barrier() {
+#if defined(REGEX_BACKEND_MEMBARRIER)
+  if (membarrier_available()) {
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    return;
+  }
+#endif
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+} // namespace regex_backend::internal
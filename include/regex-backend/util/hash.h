@@ -0,0 +1,111 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "mutils/stringify.h"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+
+namespace regex_backend::internal {
+
+///
+/// A 128 bit hash, accumulated from a stream of 64 bit words
+///
+/// each half absorbs every word through its own multiplier, and finish() runs both halves through a
+/// full avalanche, feeding each into the other, so every bit of the result depends on every word.
+/// This is not a cryptographic hash: distinct streams collide rarely, but they may collide
+///
+struct StructuralHash {
+  uint64_t low  = 0x9e3779b97f4a7c15;
+  uint64_t high = 0xc2b2ae3d27d4eb4f;
+
+  void mix(uint64_t word) {
+    low  = std::rotl(low ^ (word * 0xff51afd7ed558ccd), 29) * 0xbf58476d1ce4e5b9;
+    high = std::rotl(high ^ (word * 0xc4ceb9fe1a85ec53), 31) * 0x94d049bb133111eb;
+  }
+
+  ///
+  /// The final hash of the words mixed so far
+  ///
+  StructuralHash finish() const {
+    // the murmur3 64 bit finalizer
+    auto const avalanche = [](uint64_t h) {
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccd;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53;
+      return h ^ (h >> 33);
+    };
+    StructuralHash result;
+    result.low  = avalanche(low ^ std::rotl(high, 32));
+    result.high = avalanche(high + result.low);
+    return result;
+  }
+
+  bool operator==(StructuralHash const& other) const = default;
+};
+
+///
+/// A fast (non-cryptographic) hash of a short byte string
+///
+inline uint64_t hash_bytes(void const* data, size_t size) {
+  auto const bytes = static_cast<unsigned char const*>(data);
+  uint64_t h       = 0x9e3779b97f4a7c15 ^ (size * 0xff51afd7ed558ccd);
+  size_t i         = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    h = std::rotl(h ^ (word * 0xbf58476d1ce4e5b9), 31) * 0x94d049bb133111eb;
+  }
+  uint64_t tail = 0;
+  if (bytes) { // an empty span may hold a null pointer, which memcpy must not be given even for 0 bytes
+    std::memcpy(&tail, bytes + i, size - i);
+  }
+  h ^= tail * 0xbf58476d1ce4e5b9;
+  h ^= h >> 29;
+  h *= 0x94d049bb133111eb;
+  return h ^ (h >> 32);
+}
+
+///
+/// Hash a value held by a machine, values without a std::hash are hashed through their string form
+///
+template <typename T> uint64_t hash_value(T const& value) {
+  if constexpr (requires { std::hash<T>{}(value); }) {
+    return std::hash<T>{}(value);
+  } else {
+    return std::hash<std::string>{}(mutils::stringify(value));
+  }
+}
+
+}; // namespace regex_backend::internal
+
+template <> struct std::hash<regex_backend::internal::StructuralHash> {
+  size_t operator()(regex_backend::internal::StructuralHash const& hash) const {
+    return hash.low ^ hash.high;
+  }
+};
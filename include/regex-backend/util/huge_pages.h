@@ -0,0 +1,120 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+#if defined(__linux__)
+#  include <sys/mman.h>
+#endif
+
+namespace regex_backend::internal {
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+///
+/// An allocator which backs large allocations with 2MB pages where possible
+///
+/// allocations of at least one huge page are served from anonymous mappings aligned to
+/// HUGE_PAGE_SIZE, and the kernel is advised (MADV_HUGEPAGE) to back them with transparent huge pages.
+/// If the kernel refuses, we silently keep the regular pages, and on platforms without mmap (or for
+/// small allocations, which gain nothing from huge pages) we fall back to std::allocator
+///
+template <typename T> struct HugePageAllocator {
+  using value_type = T;
+
+  HugePageAllocator() = default;
+
+  template <typename U> HugePageAllocator(HugePageAllocator<U> const&) {
+  }
+
+  T* allocate(size_t n) {
+#if defined(__linux__)
+    auto const bytes = n * sizeof(T);
+    if (bytes >= HUGE_PAGE_SIZE) {
+      return static_cast<T*>(map_huge(mapping_size(bytes)));
+    }
+#endif
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+#if defined(__linux__)
+    auto const bytes = n * sizeof(T);
+    if (bytes >= HUGE_PAGE_SIZE) {
+      munmap(p, mapping_size(bytes));
+      return;
+    }
+#endif
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U> bool operator==(HugePageAllocator<U> const&) const {
+    return true;
+  }
+
+private:
+  static size_t mapping_size(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+
+#if defined(__linux__)
+  static void* map_huge(size_t len) {
+    constexpr int prot  = PROT_READ | PROT_WRITE;
+    constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    // over-allocate by a page so the mapping can be trimmed down to a 2MB boundary
+    void* raw = mmap(nullptr, len + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (raw == MAP_FAILED) {
+      // no room for the alignment slack, settle for an unaligned mapping
+      raw = mmap(nullptr, len, prot, flags, -1, 0);
+      if (raw == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      return raw;
+    }
+
+    auto const base    = reinterpret_cast<uintptr_t>(raw);
+    auto const aligned = (base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    auto const head    = aligned - base;
+    auto const tail    = HUGE_PAGE_SIZE - head;
+    if (head) {
+      munmap(raw, head);
+    }
+    if (tail) {
+      munmap(reinterpret_cast<void*>(aligned + len), tail);
+    }
+
+#  if defined(MADV_HUGEPAGE)
+    // this is purely advisory, the mapping works just the same if it is refused
+    madvise(reinterpret_cast<void*>(aligned), len, MADV_HUGEPAGE);
+#  endif
+    return reinterpret_cast<void*>(aligned);
+  }
+#endif
+};
+
+} // namespace regex_backend::internal
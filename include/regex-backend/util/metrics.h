@@ -0,0 +1,221 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// The operations which latencies are tracked for
+///
+enum class MatchOperation {
+  Find,
+  Matches,
+  Scan,
+};
+
+///
+/// Latency percentiles of a single operation, in nanoseconds
+///
+/// percentiles are resolved to the lower bound of their histogram bucket,
+/// which is accurate to within 25%
+///
+struct LatencySummary {
+  uint64_t count   = 0;
+  uint64_t p50_ns  = 0;
+  uint64_t p99_ns  = 0;
+  uint64_t p999_ns = 0;
+  uint64_t max_ns  = 0;
+};
+
+struct MatchMetricsSnapshot {
+  LatencySummary find;
+  LatencySummary matches;
+  LatencySummary scan;
+
+  // number of matches ending in each accepting state (i.e per value / pattern)
+  std::vector<uint64_t> hits;
+};
+
+///
+/// A lightweight, thread-safe collector for match latencies and per-pattern hit counts
+///
+/// every thread records into one of SHARD_COUNT cache-line aligned shards using relaxed atomics,
+/// so recording never blocks, and almost never contends. A snapshot merges all shards without locking
+///
+class MatchMetrics {
+public:
+  constexpr static size_t SHARD_COUNT = 16;
+
+private:
+  // log-linear buckets, each power of two is split into 4 sub-buckets
+  constexpr static size_t SUB_BUCKET_BITS = 2;
+  constexpr static size_t SUB_BUCKETS     = 1 << SUB_BUCKET_BITS;
+  constexpr static size_t MAX_LATENCY_LOG = 40; // ~18 minutes, anything longer is clamped
+  constexpr static size_t BUCKET_COUNT    = SUB_BUCKETS * (MAX_LATENCY_LOG - SUB_BUCKET_BITS + 2);
+  constexpr static size_t OPERATION_COUNT = 3;
+
+  using Histogram = std::array<std::atomic<uint64_t>, BUCKET_COUNT>;
+
+  struct alignas(64) Shard {
+    std::array<Histogram, OPERATION_COUNT> latencies{};
+    std::array<std::atomic<uint64_t>, OPERATION_COUNT> max_latency{};
+    std::unique_ptr<std::atomic<uint64_t>[]> hits;
+  };
+
+  size_t m_hit_slots;
+  std::unique_ptr<Shard[]> m_shards;
+
+public:
+  ///
+  /// hit_slots is the number of distinct hit counters to track,
+  /// usually CompiledStateMachine::accepting_states()
+  ///
+  explicit MatchMetrics(size_t hit_slots = 0) : m_hit_slots(hit_slots), m_shards(new Shard[SHARD_COUNT]) {
+    for (size_t s = 0; s < SHARD_COUNT; s++) {
+      m_shards[s].hits.reset(new std::atomic<uint64_t>[hit_slots]);
+    }
+    reset();
+  }
+
+  void record_latency(MatchOperation op, uint64_t ns) {
+    auto& shard = local_shard();
+    auto const o = static_cast<size_t>(op);
+    shard.latencies[o][bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    auto& max = shard.max_latency[o];
+    auto prev = max.load(std::memory_order_relaxed);
+    while (prev < ns && !max.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+  }
+
+  void record_hit(size_t slot) {
+    if (slot < m_hit_slots) {
+      local_shard().hits[slot].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  MatchMetricsSnapshot snapshot() const {
+    MatchMetricsSnapshot snap;
+    snap.find    = summarize(MatchOperation::Find);
+    snap.matches = summarize(MatchOperation::Matches);
+    snap.scan    = summarize(MatchOperation::Scan);
+
+    snap.hits.assign(m_hit_slots, 0);
+    for (size_t s = 0; s < SHARD_COUNT; s++) {
+      for (size_t i = 0; i < m_hit_slots; i++) {
+        snap.hits[i] += m_shards[s].hits[i].load(std::memory_order_relaxed);
+      }
+    }
+    return snap;
+  }
+
+  ///
+  /// Clear all recorded data
+  ///
+  /// Note: recordings made concurrently with a reset may be partially kept
+  ///
+  void reset() {
+    for (size_t s = 0; s < SHARD_COUNT; s++) {
+      auto& shard = m_shards[s];
+      for (size_t o = 0; o < OPERATION_COUNT; o++) {
+        for (auto& b : shard.latencies[o]) {
+          b.store(0, std::memory_order_relaxed);
+        }
+        shard.max_latency[o].store(0, std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < m_hit_slots; i++) {
+        shard.hits[i].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+private:
+  Shard& local_shard() const {
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard             = next_shard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+    return m_shards[shard];
+  }
+
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+      return ns;
+    }
+    size_t const log = std::min<size_t>(std::bit_width(ns) - 1, MAX_LATENCY_LOG);
+    if (log == MAX_LATENCY_LOG && (ns >> MAX_LATENCY_LOG) > 1) {
+      return BUCKET_COUNT - 1;
+    }
+    size_t const sub = (ns >> (log - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return SUB_BUCKETS * (log - SUB_BUCKET_BITS + 1) + sub;
+  }
+
+  static uint64_t bucket_lower_bound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    size_t const log = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    size_t const sub = bucket % SUB_BUCKETS;
+    return (uint64_t(1) << log) | (uint64_t(sub) << (log - SUB_BUCKET_BITS));
+  }
+
+  LatencySummary summarize(MatchOperation op) const {
+    auto const o = static_cast<size_t>(op);
+    std::array<uint64_t, BUCKET_COUNT> merged{};
+    LatencySummary summary;
+    for (size_t s = 0; s < SHARD_COUNT; s++) {
+      for (size_t b = 0; b < BUCKET_COUNT; b++) {
+        merged[b] += m_shards[s].latencies[o][b].load(std::memory_order_relaxed);
+      }
+      summary.max_ns = std::max(summary.max_ns, m_shards[s].max_latency[o].load(std::memory_order_relaxed));
+    }
+    for (auto c : merged) {
+      summary.count += c;
+    }
+
+    auto const percentile = [&](uint64_t basis_points) -> uint64_t {
+      // the rank of the requested percentile, rounded up
+      uint64_t const rank = (summary.count * basis_points + 9999) / 10000;
+      uint64_t seen       = 0;
+      for (size_t b = 0; b < BUCKET_COUNT; b++) {
+        seen += merged[b];
+        if (seen >= rank && seen) {
+          return bucket_lower_bound(b);
+        }
+      }
+      return 0;
+    };
+    summary.p50_ns  = percentile(5000);
+    summary.p99_ns  = percentile(9900);
+    summary.p999_ns = percentile(9990);
+    return summary;
+  }
+};
+
+} // namespace regex_backend::internal
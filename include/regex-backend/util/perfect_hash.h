@@ -0,0 +1,199 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include "./hash.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// A static minimal perfect hash table, mapping a fixed set of byte strings onto 32 bit payloads
+///
+/// keys are split into buckets of ~4 by their hash, and every bucket is assigned a 'pilot', which
+/// displaces its keys into slots no other key occupies (largest buckets first, as in PTHash).
+/// A lookup is therefore one hash of the input, one pilot load and one memcmp against the only
+/// key that could possibly match
+///
+class PerfectHashTable {
+  struct Slot {
+    uint32_t offset  = 0; // into m_bytes
+    uint32_t length  = 0;
+    uint32_t payload = 0;
+  };
+
+  std::vector<uint64_t> m_pilots; // the displacement of every bucket
+  std::vector<Slot> m_slots;      // exactly one slot per key
+  std::vector<char> m_bytes;      // the keys, back to back
+  size_t m_min_length = std::numeric_limits<size_t>::max();
+  size_t m_max_length = 0;
+
+  constexpr static size_t BUCKET_SIZE = 4;
+
+  static uint64_t mix(uint64_t h) {
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 29;
+    return h;
+  }
+
+  static size_t reduce(uint64_t h, size_t range) {
+    return static_cast<size_t>((static_cast<unsigned __int128>(h) * range) >> 64);
+  }
+
+  size_t bucket_of(uint64_t h) const {
+    return reduce(h, m_pilots.size());
+  }
+
+  size_t slot_of(uint64_t h, uint64_t pilot) const {
+    return reduce(mix(h ^ (pilot * 0x9e3779b97f4a7c15)), m_slots.size());
+  }
+
+public:
+  ///
+  /// A key to build the table from
+  ///
+  struct Key {
+    char const* data;
+    size_t length;
+    uint32_t payload;
+  };
+
+  ///
+  /// Build the table over 'keys', which must be distinct
+  ///
+  /// returns false (and leaves the table empty) when no perfect hash could be found,
+  /// which only happens when two keys share a full 64 bit hash
+  ///
+  bool build(std::vector<Key> const& keys) {
+    *this = {};
+    if (keys.empty()) {
+      return true;
+    }
+
+    size_t total = 0;
+    std::vector<uint64_t> hashes;
+    hashes.reserve(keys.size());
+    for (auto const& key : keys) {
+      hashes.push_back(hash_bytes(key.data, key.length));
+      total += key.length;
+    }
+    if (total > std::numeric_limits<uint32_t>::max()) {
+      return false;
+    }
+
+    m_pilots.assign((keys.size() + BUCKET_SIZE - 1) / BUCKET_SIZE, 0);
+    m_slots.resize(keys.size());
+
+    std::vector<std::vector<uint32_t>> buckets(m_pilots.size());
+    for (uint32_t i = 0; i < keys.size(); i++) {
+      buckets[bucket_of(hashes[i])].push_back(i);
+    }
+    std::vector<uint32_t> order(buckets.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+
+    // search for a pilot placing every key of the bucket into a free slot, the final buckets
+    // have few slots left to choose from, so the search is bounded generously
+    std::vector<bool> taken(keys.size(), false);
+    std::vector<size_t> placed;
+    uint64_t const max_pilot = std::max<uint64_t>(1 << 16, keys.size() * 64);
+    for (auto const b : order) {
+      auto const& bucket = buckets[b];
+      if (bucket.empty()) {
+        break;
+      }
+      bool found = false;
+      for (uint64_t pilot = 0; pilot < max_pilot && !found; pilot++) {
+        placed.clear();
+        found = true;
+        for (auto const k : bucket) {
+          auto const slot = slot_of(hashes[k], pilot);
+          if (taken[slot] || std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+            found = false;
+            break;
+          }
+          placed.push_back(slot);
+        }
+        if (found) {
+          m_pilots[b] = pilot;
+          for (size_t i = 0; i < bucket.size(); i++) {
+            taken[placed[i]] = true;
+            auto const& key  = keys[bucket[i]];
+            m_slots[placed[i]] = Slot{.offset  = static_cast<uint32_t>(m_bytes.size()),
+                                      .length  = static_cast<uint32_t>(key.length),
+                                      .payload = key.payload};
+            m_bytes.insert(m_bytes.end(), key.data, key.data + key.length);
+          }
+        }
+      }
+      if (!found) {
+        *this = {};
+        return false;
+      }
+    }
+
+    for (auto const& key : keys) {
+      m_min_length = std::min(m_min_length, key.length);
+      m_max_length = std::max(m_max_length, key.length);
+    }
+    return true;
+  }
+
+  ///
+  /// Find the payload of the key equal to [data, data + length), or null
+  ///
+  uint32_t const* find(void const* data, size_t length) const {
+    if (length < m_min_length || length > m_max_length) {
+      return nullptr;
+    }
+    auto const h     = hash_bytes(data, length);
+    auto const& slot = m_slots[slot_of(h, m_pilots[bucket_of(h)])];
+    if (slot.length != length || std::memcmp(m_bytes.data() + slot.offset, data, length) != 0) {
+      return nullptr;
+    }
+    return &slot.payload;
+  }
+
+  ///
+  /// The number of keys held
+  ///
+  size_t size() const {
+    return m_slots.size();
+  }
+
+  bool empty() const {
+    return m_slots.empty();
+  }
+};
+
+}; // namespace regex_backend::internal
@@ -0,0 +1,53 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+//
+// Static tracepoints, used to attribute time spent within the library to
+// machine construction, optimization and scanning (i.e with bpftrace or perf)
+//
+// When compiled with REGEX_BACKEND_USDT defined (the meson 'usdt' option) and <sys/sdt.h> is
+// available, each probe becomes a USDT probe of the 'regex_backend' provider, which costs a single
+// nop until something attaches to it. Otherwise, the probes compile away to their (unused) arguments.
+//
+// Probes:
+//   optimize__start(nodes)             optimize__done(nodes)
+//   pass__start(name, nodes)           pass__done(name, nodes)
+//   merge__start(nodes, merged_nodes)  merge__done(nodes)
+//   engine__select(name, states)
+//   scan__start(bytes)                 scan__done(bytes, matches)
+//   tier__promote(tier)
+//   partition__done(patterns, partitions)
+//
+
+#pragma once
+
+#if defined(REGEX_BACKEND_USDT) && __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define RB_PROBE(name)              DTRACE_PROBE(regex_backend, name)
+#  define RB_PROBE1(name, a)          DTRACE_PROBE1(regex_backend, name, a)
+#  define RB_PROBE2(name, a, b)       DTRACE_PROBE2(regex_backend, name, a, b)
+#else
+// the arguments are still consumed (they are all cheap), so values only read by probes are not unused
+#  define RB_PROBE(name)
+#  define RB_PROBE1(name, a)          ((void)(a))
+#  define RB_PROBE2(name, a, b)       ((void)(a), (void)(b))
+#endif
@@ -0,0 +1,189 @@
+// Copyright (c) 2023 Samir Bioud
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace regex_backend::internal {
+
+///
+/// A fixed-size pool of threads which executes batches of work, balancing load through work stealing
+///
+/// each worker is handed a contiguous block of batches, and takes from the front of its own queue,
+/// keeping neighbouring batches (and therefore neighbouring memory) on the same core. Once a worker
+/// runs dry, it steals from the back of the other workers' queues
+///
+class WorkStealingPool {
+public:
+  struct Batch {
+    size_t begin;
+    size_t end;
+  };
+
+  using Task_T = std::function<void(size_t begin, size_t end)>;
+
+private:
+  struct alignas(64) Worker {
+    std::mutex lock;
+    std::deque<Batch> batches;
+  };
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<std::thread> m_threads;
+
+  Task_T const* m_task = nullptr;
+  std::atomic<size_t> m_unclaimed = 0; // batches not yet taken by any worker
+  std::atomic<size_t> m_remaining = 0; // batches not yet completed
+  bool m_stop                     = false;
+
+  std::mutex m_job_lock; // only a single job runs at once
+  std::mutex m_sleep_lock;
+  std::condition_variable m_wake;
+  std::mutex m_done_lock;
+  std::condition_variable m_done;
+
+public:
+  explicit WorkStealingPool(size_t threads = std::thread::hardware_concurrency()) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++) {
+      m_workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+      m_threads.emplace_back([this, i] {
+        work(i);
+      });
+    }
+  }
+
+  WorkStealingPool(WorkStealingPool const&)            = delete;
+  WorkStealingPool& operator=(WorkStealingPool const&) = delete;
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard lk(m_sleep_lock);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto& t : m_threads) {
+      t.join();
+    }
+  }
+
+  size_t size() const {
+    return m_workers.size();
+  }
+
+  ///
+  /// Run the task over every batch, blocking until all of them have completed
+  ///
+  void run(std::vector<Batch> const& batches, Task_T const& task) {
+    if (batches.empty()) {
+      return;
+    }
+    std::lock_guard job(m_job_lock);
+
+    m_task = &task;
+    m_remaining.store(batches.size());
+    {
+      std::lock_guard lk(m_sleep_lock);
+      m_unclaimed.store(batches.size());
+    }
+
+    // hand each worker a contiguous block of batches
+    size_t const per_worker = (batches.size() + size() - 1) / size();
+    for (size_t w = 0; w < size(); w++) {
+      auto const first = std::min(batches.size(), w * per_worker);
+      auto const last  = std::min(batches.size(), first + per_worker);
+      std::lock_guard lk(m_workers[w]->lock);
+      m_workers[w]->batches.insert(m_workers[w]->batches.end(), batches.begin() + first, batches.begin() + last);
+    }
+    m_wake.notify_all();
+
+    std::unique_lock lk(m_done_lock);
+    m_done.wait(lk, [&] {
+      return m_remaining.load() == 0;
+    });
+    m_task = nullptr;
+  }
+
+private:
+  void work(size_t self) {
+    while (true) {
+      Batch batch;
+      if (take(self, batch)) {
+        (*m_task)(batch.begin, batch.end);
+        if (m_remaining.fetch_sub(1) == 1) {
+          std::lock_guard lk(m_done_lock);
+          m_done.notify_all();
+        }
+        continue;
+      }
+
+      std::unique_lock lk(m_sleep_lock);
+      m_wake.wait(lk, [&] {
+        return m_stop || m_unclaimed.load() > 0;
+      });
+      if (m_stop) {
+        return;
+      }
+    }
+  }
+
+  bool take(size_t self, Batch& batch) {
+    // our own work first, from the front
+    {
+      auto& own = *m_workers[self];
+      std::lock_guard lk(own.lock);
+      if (!own.batches.empty()) {
+        batch = own.batches.front();
+        own.batches.pop_front();
+        m_unclaimed.fetch_sub(1);
+        return true;
+      }
+    }
+
+    // then steal from the back of everyone else
+    for (size_t i = 1; i < size(); i++) {
+      auto& victim = *m_workers[(self + i) % size()];
+      std::lock_guard lk(victim.lock);
+      if (!victim.batches.empty()) {
+        batch = victim.batches.back();
+        victim.batches.pop_back();
+        m_unclaimed.fetch_sub(1);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+} // namespace regex_backend::internal
@@ -51,6 +51,19 @@ TEST(features, equivalence) {
   ASSERT_EQ(regex1, regex2) << "Two regexes with the same transitions declared in different orders are equivalent";
 }
 
+TEST(features, equivalence_ignores_numbering) {
+  MutableRegex regex1;
+  MutableRegex regex2;
+
+  regex1.match_sequence("AB").terminal().goback().match_sequence("CD").terminal().goback();
+  regex2.match_sequence("CD").terminal().goback().match_sequence("AB").terminal().goback();
+
+  ASSERT_EQ(regex1, regex2) << "Equivalence does not depend on the order nodes were created in";
+
+  regex2.match_sequence("EF").terminal().goback();
+  ASSERT_NE(regex1, regex2);
+}
+
 TEST(features, match_sequence) {
   MutableRegex regex;
 
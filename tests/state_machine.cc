@@ -0,0 +1,832 @@
+/// Copyright (c) 2023 Samir Bioud
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+/// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+/// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+/// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+/// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+/// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+/// OR OTHER DEALINGS IN THE SOFTWARE.
+///
+
+#include "regex-backend/builder.h"
+
+#include "regex-backend/bulk.h"
+#include "regex-backend/machine_cache.h"
+#include "regex-backend/machine_handle.h"
+#include "regex-backend/match_cache.h"
+#include "regex-backend/state_machine.h"
+#include "regex-backend/tiered.h"
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace regex_backend;
+
+using Regex = StateMachine<void, char>;
+
+static std::span<char> as_span(std::string& s) {
+  return std::span<char>(s.data(), s.size());
+}
+
+static bool full_match(Regex& regex, std::string s) {
+  return regex.matches(as_span(s));
+}
+
+static Regex keywords() {
+  Regex regex;
+
+  // clang-format off
+  regex
+    .match_sequence("for").exit_point().root()
+    .match_sequence("foreach").exit_point().root()
+    .match_sequence("while").exit_point().root()
+    .match_sequence("return").exit_point().root()
+    .optimize();
+  // clang-format on
+
+  return regex;
+}
+
+TEST(state_machine, renumber) {
+  auto regex = keywords();
+
+  std::string corpus = "while true { for x in y { return x } } foreach z { return }";
+  std::vector<size_t> visits;
+  regex.record_visits(as_span(corpus), visits);
+  regex.renumber(visits);
+
+  ASSERT_TRUE(full_match(regex, "for")) << "profile-guided renumbering preserves matches";
+  ASSERT_TRUE(full_match(regex, "foreach")) << "profile-guided renumbering preserves matches";
+  ASSERT_TRUE(full_match(regex, "while")) << "profile-guided renumbering preserves matches";
+  ASSERT_TRUE(full_match(regex, "return")) << "profile-guided renumbering preserves matches";
+  ASSERT_FALSE(full_match(regex, "fore")) << "profile-guided renumbering does not introduce matches";
+  ASSERT_FALSE(full_match(regex, "")) << "profile-guided renumbering does not introduce matches";
+
+  auto found = regex.find(as_span(corpus));
+  ASSERT_EQ(std::string(found.range.begin(), found.range.end()), "while") << "find is unaffected by renumbering";
+
+  std::string once = "for", twice = "forfor";
+  std::vector<size_t> once_visits, twice_visits;
+  keywords().record_visits(as_span(once), once_visits);
+  keywords().record_visits(as_span(once), once_visits);
+  keywords().record_visits(as_span(twice), twice_visits);
+  ASSERT_EQ(once_visits, twice_visits) << "the byte ending a match is read again by the next find()";
+}
+
+TEST(state_machine, compiled) {
+  auto regex    = keywords();
+  auto compiled = regex.compile();
+
+  for (std::string s : {"for", "foreach", "while", "return", "fore", "", "forr", "whilee"}) {
+    ASSERT_EQ((bool)regex.matches(as_span(s)), (bool)compiled.matches(as_span(s))) << "compiled matches agree on " << s;
+  }
+
+  for (std::string s : {"xx while", "foreach!", "fo for", "nothing here", "retur return"}) {
+    auto expected = regex.find(as_span(s));
+    auto found    = compiled.find(as_span(s));
+    ASSERT_EQ(std::string(expected.range.begin(), expected.range.end()),
+              std::string(found.range.begin(), found.range.end()))
+        << "compiled find agrees on " << s;
+  }
+
+  StateMachine<int, char> values;
+
+  // clang-format off
+  values
+    .match_sequence("one").exit_point(1).root()
+    .match_sequence("two").exit_point(2).root()
+    .match_sequence("three!").exit_point(3, 1).root()
+    .optimize();
+  // clang-format on
+
+  auto compiled_values = values.compile();
+  std::string two      = "two";
+  ASSERT_EQ(*compiled_values.matches(as_span(two)).value(), 2) << "values are attached to compiled accept states";
+  ASSERT_EQ(*values.matches(as_span(two)).value(), 2) << "values are attached to accept states";
+
+  std::string text = "one, three!";
+  auto found       = compiled_values.find(as_span(text));
+  ASSERT_EQ(*found.val, 1);
+  found = compiled_values.find(as_span(text).subspan(found.range.end() - as_span(text).begin()));
+  ASSERT_EQ(*found.val, 3);
+  ASSERT_EQ(std::string(found.range.begin(), found.range.end()), "three") << "back_by is respected";
+}
+
+TEST(state_machine, huge_pages) {
+  auto regex    = keywords();
+  auto compiled = regex.compile<true>();
+
+  std::string s = "foreach";
+  ASSERT_TRUE(compiled.matches(as_span(s))) << "huge page backed tables match the same as regular tables";
+
+  // large enough to be served by an aligned mapping
+  std::vector<uint32_t, internal::HugePageAllocator<uint32_t>> table(internal::HUGE_PAGE_SIZE, 7);
+  ASSERT_EQ(table.back(), 7);
+#if defined(__linux__)
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(table.data()) % internal::HUGE_PAGE_SIZE, 0) << "mappings are 2MB aligned";
+#endif
+  table.resize(internal::HUGE_PAGE_SIZE * 2, 9);
+  ASSERT_EQ(table.front(), 7) << "contents survive reallocation";
+  ASSERT_EQ(table.back(), 9);
+}
+
+TEST(state_machine, perfect_hash) {
+  StateMachine<int, char> dictionary;
+  std::vector<std::string> words;
+  for (int i = 0; i < 500; i++) {
+    words.push_back("word" + std::to_string(i * 7919));
+    dictionary.insert_sequence(words.back(), i);
+  }
+  dictionary.compact();
+  auto compiled = dictionary.compile();
+  ASSERT_EQ(compiled.literals(), words.size()) << "finite literal languages are enumerated into the hash";
+
+  for (size_t i = 0; i < words.size(); i++) {
+    ASSERT_EQ(*compiled.matches(as_span(words[i])).value(), i) << "literals keep their values";
+  }
+  for (std::string s : {"", "word", "word1", "word00", "wordx", "word7919x"}) {
+    ASSERT_EQ((bool)compiled.matches(as_span(s)), (bool)dictionary.matches(as_span(s))) << "the hash agrees on " << s;
+  }
+  for (std::string s : {words[0], words[1], std::string("word")}) {
+    ASSERT_EQ((bool)compiled.matches<true>(as_span(s)), (bool)dictionary.matches<true>(as_span(s)))
+        << "the hash does not answer eof matches of " << s;
+  }
+  std::string text = "some word15838 here";
+  auto found       = compiled.find(as_span(text));
+  ASSERT_EQ(*found.val, 2) << "find still walks the table";
+
+  Regex digit;
+  digit.match_digit().exit_point();
+  Regex number;
+  number.match_many(digit).exit_point().optimize();
+  auto compiled_number = number.compile();
+  std::string digits   = "12345";
+  ASSERT_EQ(compiled_number.literals(), 0) << "cyclic machines keep the table walk";
+  ASSERT_TRUE(compiled_number.matches(as_span(digits)));
+}
+
+TEST(state_machine, dictionary_cursor) {
+  StateMachine<int, char> dictionary;
+  std::vector<std::string> words = {"car", "card", "care", "cart", "cat", "dog", "do", "cab"};
+  for (size_t i = 0; i < words.size(); i++) {
+    dictionary.insert_sequence(words[i], (int)i);
+  }
+  dictionary.compact();
+
+  DictionaryCursor cursor(dictionary);
+  std::vector<std::string> keys;
+  for (cursor.seek_prefix("car"); cursor.valid(); cursor.next()) {
+    keys.emplace_back(cursor.key());
+    ASSERT_EQ(words[cursor.value()], cursor.key()) << "values follow their keys";
+  }
+  ASSERT_EQ(keys, (std::vector<std::string>{"car", "card", "care", "cart"})) << "prefixed keys come out in order";
+
+  keys.clear();
+  for (cursor.seek("cas"); cursor.valid() && keys.size() < 3; cursor.next()) {
+    keys.emplace_back(cursor.key());
+  }
+  ASSERT_EQ(keys, (std::vector<std::string>{"cat", "do", "dog"})) << "seek finds the first key not less than the bound";
+
+  ASSERT_FALSE(cursor.seek_prefix("x"));
+  ASSERT_FALSE(cursor.seek("e"));
+  ASSERT_TRUE(cursor.seek(""));
+  ASSERT_EQ(cursor.key(), "cab");
+}
+
+TEST(state_machine, fuzzy_lookup) {
+  StateMachine<int, char> dictionary;
+  std::vector<std::string> words = {"while", "which", "whale", "for", "foreach", "return", "retry"};
+  for (size_t i = 0; i < words.size(); i++) {
+    dictionary.insert_sequence(words[i], (int)i);
+  }
+  dictionary.compact();
+
+  auto found = dictionary.fuzzy_lookup("whle", 1);
+  ASSERT_EQ(found.size(), 2);
+  ASSERT_EQ(found[0].key, "whale") << "results come out in order";
+  ASSERT_EQ(found[1].key, "while");
+  ASSERT_EQ(found[1].distance, 1);
+  ASSERT_EQ(*found[1].value, 0) << "values are attached to fuzzy matches";
+
+  ASSERT_EQ(dictionary.fuzzy_lookup("retrun", 1).size(), 0) << "a transposition is two edits";
+  ASSERT_EQ(dictionary.fuzzy_lookup("retrun", 2).size(), 2);
+  ASSERT_EQ(dictionary.fuzzy_lookup("for", 0).size(), 1) << "no edits is an exact lookup";
+
+  Regex digit;
+  digit.match_digit().exit_point();
+  Regex number;
+  number.match_many(digit).exit_point().optimize();
+  ASSERT_EQ(number.fuzzy_lookup("12a", 1).size(), 11) << "cyclic machines are bounded by the edit distance";
+}
+
+TEST(state_machine, approximate_scan) {
+  StateMachine<int, char> signature;
+  signature.match_sequence("virus").exit_point(7);
+
+  std::string text = "a vyrus, a virs, a virus and a vairus";
+  ApproximateScanner<StateMachine<int, char>> edits(signature, 1);
+  std::vector<std::pair<std::string, size_t>> found;
+  edits.scan(as_span(text), [&](auto const& m) {
+    found.emplace_back(std::string(m.range.begin(), m.range.end()), m.errors);
+    ASSERT_EQ(*m.value, 7);
+  });
+  ASSERT_EQ(found.size(), 4) << "substitutions, deletions, exact matches and insertions are found";
+  ASSERT_EQ(found[0], std::make_pair(std::string("vyrus"), size_t(1)));
+  ASSERT_EQ(found[2], std::make_pair(std::string("virus"), size_t(0)));
+
+  ApproximateScanner<StateMachine<int, char>, ApproximateMode::Mismatches> mismatches(signature, 1);
+  ASSERT_EQ(mismatches.scan(as_span(text), [](auto const&) {}), 3) << "only substitutions are tolerated (vyrus, virus, airus)";
+
+  std::string clean = "nothing to see";
+  ASSERT_GT(edits.find(as_span(clean)).errors, 1);
+}
+
+TEST(state_machine, algebra) {
+  Regex digits;
+  digits.match_digit().exit_point().root().match_digit().match_digit().exit_point().optimize(); // 1 or 2 digits
+  Regex ones;
+  ones.match_sequence("1").exit_point().root().match_sequence("11").exit_point().optimize();
+
+  auto either = unite(digits, ones);
+  auto both   = intersect(digits, ones);
+  auto minus  = subtract(digits, ones);
+  auto other  = complement(ones);
+  LazyProduct<Regex> lazy(ProductOperation::Difference, digits, ones);
+
+  for (std::string s : {"1", "11", "7", "42", "", "111", "a"}) {
+    bool const in_digits = full_match(digits, s);
+    bool const in_ones   = full_match(ones, s);
+    ASSERT_EQ(full_match(either, s), in_digits || in_ones) << "union of " << s;
+    ASSERT_EQ(full_match(both, s), in_digits && in_ones) << "intersection of " << s;
+    ASSERT_EQ(full_match(minus, s), in_digits && !in_ones) << "difference of " << s;
+    ASSERT_EQ(full_match(other, s), !in_ones) << "complement of " << s;
+    ASSERT_EQ((bool)lazy.matches(as_span(s)), in_digits && !in_ones) << "lazy difference of " << s;
+  }
+  auto const reached = lazy.states();
+  std::string repeat = "42";
+  lazy.matches(as_span(repeat));
+  ASSERT_EQ(lazy.states(), reached) << "resolved transitions are reused";
+
+  std::string text = "7 11 42 1 100 9";
+  std::vector<std::string> eager, lazily;
+  minus.compile().scan(as_span(text), [&](auto const& r) { eager.emplace_back(r.range.begin(), r.range.end()); });
+  lazy.scan(as_span(text), [&](auto const& r) { lazily.emplace_back(r.range.begin(), r.range.end()); });
+  ASSERT_EQ(lazily, eager) << "scanning a lazy product finds what the compiled product finds";
+  ASSERT_EQ(lazily.size(), 5); // 7, 42, 10, 0 and 9
+  auto found = lazy.find(as_span(text));
+  ASSERT_EQ(std::string(found.range.begin(), found.range.end()), "7");
+
+  Regex last;
+  last.match_sequence("1").match_eof().exit_point();
+  LazyProduct<Regex> lazy_last(ProductOperation::Union, last, digits);
+  std::string one = "1";
+  ASSERT_TRUE(lazy_last.matches<true>(as_span(one))) << "lazy products follow eof transitions";
+  ASSERT_EQ((bool)lazy_last.matches<true>(as_span(repeat)), (bool)unite(last, digits).matches<true>(as_span(repeat)));
+
+  StateMachine<int, char> rules;
+  rules.match_sequence("drop").exit_point(1).root().match_sequence("deny").exit_point(2).optimize();
+  StateMachine<int, char> allow;
+  allow.match_sequence("deny").exit_point(0).optimize();
+  auto filtered    = subtract(rules, allow);
+  std::string drop = "drop", deny = "deny";
+  ASSERT_EQ(*filtered.matches(as_span(drop)).value(), 1) << "products keep the values of the left machine";
+  ASSERT_FALSE(filtered.matches(as_span(deny)));
+}
+
+TEST(state_machine, overlap) {
+  Regex digits;
+  digits.match_digit().exit_point().root().match_digit().match_digit().exit_point().optimize();
+  Regex ones;
+  ones.match_sequence("1").exit_point().root().match_sequence("11").exit_point().optimize();
+  auto words = keywords();
+
+  ASSERT_TRUE(is_subset(ones, digits));
+  ASSERT_FALSE(is_subset(digits, ones));
+  ASSERT_TRUE(intersects(digits, ones));
+  ASSERT_FALSE(intersects(digits, words));
+
+  ASSERT_FALSE(digits.is_empty());
+  ASSERT_TRUE(intersect(digits, words).is_empty());
+  ASSERT_TRUE(Regex().is_empty());
+}
+
+TEST(state_machine, repeat) {
+  Regex digit;
+  digit.match_digit().exit_point().optimize();
+
+  Regex id;
+  id.match_sequence("#").match_repeat(digit, 1, 3).exit_point().optimize();
+  for (std::string s : {"#1", "#12", "#123"}) {
+    ASSERT_TRUE(full_match(id, s)) << "repeats between min and max match " << s;
+  }
+  for (std::string s : {"#", "#1234", "#1a"}) {
+    ASSERT_FALSE(full_match(id, s)) << "repeats outside of min and max do not match " << s;
+  }
+
+  Regex optional;
+  optional.match_sequence("x").match_repeat(digit, 0, 2).match_sequence("y").exit_point();
+  ASSERT_TRUE(full_match(optional, "xy")) << "a minimum of 0 keeps the current cursors";
+  ASSERT_TRUE(full_match(optional, "x12y"));
+  ASSERT_FALSE(full_match(optional, "x123y"));
+
+  Regex at_least;
+  at_least.match_repeat(digit, 2, Regex::REPEAT_UNBOUNDED).exit_point();
+  ASSERT_FALSE(full_match(at_least, "1"));
+  ASSERT_TRUE(full_match(at_least, "12"));
+  ASSERT_TRUE(full_match(at_least, "1234567890")) << "unbounded repeats continue indefinitely";
+
+  Regex long_id;
+  long_id.match_repeat(digit, 1, 19).exit_point();
+  ASSERT_TRUE(full_match(long_id, "1234567890123456789"));
+  ASSERT_FALSE(full_match(long_id, "12345678901234567890"));
+}
+
+TEST(state_machine, call) {
+  // a comment body which is large enough to be shared rather than inlined
+  auto comment = std::make_shared<Regex>();
+  comment->match_sequence("/*");
+  for (char c = 'a'; c <= 'z'; c++) {
+    comment->match_sequence(std::string(1, c));
+  }
+  comment->match_sequence("*/").exit_point();
+  ASSERT_FALSE(comment->has_calls());
+
+  Regex twice;
+  twice.match_call(comment).match_sequence(";").match_call(comment).exit_point().optimize();
+  ASSERT_TRUE(twice.has_calls()) << "large sub-machines are called rather than copied";
+  ASSERT_TRUE(full_match(twice, "/*abcdefghijklmnopqrstuvwxyz*/;/*abcdefghijklmnopqrstuvwxyz*/"));
+  ASSERT_FALSE(full_match(twice, "/*abcdefghijklmnopqrstuvwxyz*/;"));
+
+  Regex small;
+  small.match_digit().exit_point();
+  Regex inlined;
+  inlined.match_call(std::make_shared<Regex>(small)).exit_point();
+  ASSERT_FALSE(inlined.has_calls()) << "small sub-machines are inlined";
+
+  // balanced brackets, as a sub-machine calling itself
+  auto nested = std::make_shared<Regex>();
+  Regex& n    = *nested;
+  n.match_sequence("(").exit_point().root().match_sequence("(").match_call(nested).match_sequence(")");
+  n.exit_point();
+  Regex brackets;
+  brackets.match_sequence("(").match_call(nested).match_sequence(")").exit_point();
+  ASSERT_TRUE(full_match(brackets, "(()"));
+  ASSERT_TRUE(full_match(brackets, "((())"));
+  ASSERT_FALSE(full_match(brackets, "(()))"));
+
+  Regex once;
+  once.match_call(comment).exit_point();
+  Regex other_comment = *comment;
+  Regex once_other;
+  once_other.match_call(std::make_shared<Regex>(other_comment)).exit_point();
+  ASSERT_TRUE(once == Regex(once));
+  ASSERT_FALSE(once == once_other) << "machines calling different sub-machines differ";
+  ASSERT_NE(once.structural_hash(), once_other.structural_hash());
+
+  // a recursive call refers to whichever machine holds it, and does not keep that machine alive
+  auto copy = std::make_shared<Regex>(n);
+  n.root().match_sequence("x").exit_point();
+  Regex copied_brackets;
+  copied_brackets.match_sequence("(").match_call(copy).match_sequence(")").exit_point();
+  ASSERT_TRUE(full_match(brackets, "((x))"));
+  ASSERT_FALSE(full_match(copied_brackets, "((x))")) << "the copy recurses into itself, not the original";
+  ASSERT_TRUE(full_match(copied_brackets, "((())"));
+
+  std::weak_ptr<Regex> weak = nested;
+  nested.reset();
+  brackets = Regex();
+  ASSERT_TRUE(weak.expired()) << "a machine calling itself is freed with its last owner";
+}
+
+TEST(state_machine, partition) {
+  std::vector<StateMachine<int, char>> patterns(4);
+  patterns[0].match_sequence("if").exit_point(1).optimize();
+  patterns[1].match_sequence("else").exit_point(2).optimize();
+  patterns[2].match_sequence("while").exit_point(3).optimize();
+  patterns[3].match_sequence("return").exit_point(4).optimize();
+
+  ASSERT_EQ(partition_patterns(patterns, 1000).size(), 1);
+  PartitionedScanner<StateMachine<int, char>> scanner(patterns, 8);
+  ASSERT_GT(scanner.partitions(), 1) << "the union does not fit the budget";
+  for (size_t i = 0; i < scanner.partitions(); i++) {
+    ASSERT_LE(scanner.get_partition(i).size(), 8 + 1) << "the dead state is not counted";
+  }
+
+  std::string text;
+  while (text.size() < 3 * decltype(scanner)::Scanner_T::BLOCK_SIZE) {
+    text += "if (x) return 1; else while (y) {}\n";
+  }
+  size_t const lines = text.size() / 35;
+  size_t hits[5]     = {};
+  auto const count   = scanner.scan(as_span(text), [&](size_t, auto const& result) {
+    ASSERT_TRUE(patterns[*result.val - 1].matches(result.range)) << "results carry the value of their pattern";
+    hits[*result.val]++;
+  });
+  ASSERT_EQ(count, 4 * lines);
+  for (int keyword = 1; keyword <= 4; keyword++) {
+    ASSERT_EQ(hits[keyword], lines) << "every occurrence of keyword " << keyword << " across the blocks";
+  }
+}
+
+TEST(state_machine, multi_scanner) {
+  Regex integer, identifier, comment;
+  integer.match_many(Regex().match_digit().exit_point()).exit_point().optimize();
+  identifier.match_alpha().match_many_optionally(Regex().match_alpha().exit_point()).exit_point().optimize();
+  comment.match_sequence("/*").match_many_optionally(Regex().match_any_of("abc ").exit_point()).match_sequence("*/");
+  comment.exit_point().optimize();
+  auto const compiled = std::vector{integer.compile(), identifier.compile(), comment.compile()};
+
+  MultiScanner<Regex> scanner;
+  for (auto const& machine : compiled) {
+    scanner.add(machine);
+  }
+
+  std::string text(decltype(scanner)::BLOCK_SIZE + 10, ' '); // skipped by the prefilter
+  while (text.size() < 4 * decltype(scanner)::BLOCK_SIZE) {
+    text += "x = 42 /* a b c */ + yz;";
+    text += std::string(text.size() % 7 * 100, ' ');
+  }
+  std::vector<std::vector<std::string>> found(compiled.size());
+  auto const count = scanner.scan(as_span(text), [&](size_t id, auto const& result) {
+    found[id].emplace_back(result.range.begin(), result.range.end());
+  });
+
+  size_t expected_count = 0;
+  for (size_t id = 0; id < compiled.size(); id++) {
+    std::vector<std::string> expected;
+    expected_count += compiled[id].scan(as_span(text), [&](auto const& result) {
+      expected.emplace_back(result.range.begin(), result.range.end());
+    });
+    ASSERT_EQ(found[id], expected) << "machine " << id << " yields what it would alone";
+  }
+  ASSERT_EQ(count, expected_count);
+  ASSERT_EQ(found[2].front(), "/* a b c */");
+}
+
+TEST(state_machine, metrics) {
+  StateMachine<int, char> values;
+  values.match_sequence("one").exit_point(1).root().match_sequence("two").exit_point(2).root().optimize();
+
+  auto compiled = values.compile();
+  MatchMetrics metrics(compiled.accepting_states());
+  compiled.attach_metrics(&metrics);
+
+  std::string one = "one";
+  std::string two = "two";
+  auto one_slot   = compiled.slot_of(compiled.matches(as_span(one)).value());
+  auto two_slot   = compiled.slot_of(compiled.matches(as_span(two)).value());
+  for (int i = 0; i < 99; i++) {
+    compiled.matches(as_span(two));
+  }
+
+  std::string text = "two one two three";
+  auto matched     = compiled.scan(as_span(text), [](auto const&) {});
+  ASSERT_EQ(matched, 3);
+
+  auto snap = metrics.snapshot();
+  ASSERT_EQ(snap.matches.count, 101);
+  ASSERT_EQ(snap.scan.count, 1);
+  ASSERT_EQ(snap.find.count, 0);
+  ASSERT_LE(snap.matches.p50_ns, snap.matches.p999_ns);
+  ASSERT_LE(snap.matches.p999_ns, snap.matches.max_ns);
+  ASSERT_EQ(snap.hits[one_slot], 2) << "hits are counted per value";
+  ASSERT_EQ(snap.hits[two_slot], 102) << "hits are counted per value";
+}
+
+TEST(state_machine, bulk) {
+  auto regex    = keywords();
+  auto compiled = regex.compile();
+  WorkStealingPool pool(4);
+
+  std::vector<std::string> records;
+  for (size_t i = 0; i < 20000; i++) {
+    switch (i % 4) {
+      case 0: records.push_back("for"); break;
+      case 1: records.push_back("while x"); break;
+      case 2: records.push_back(std::string(i % 1000, 'x') + " return"); break;
+      case 3: records.push_back("return"); break;
+    }
+  }
+  std::vector<std::span<char>> inputs;
+  for (auto& r : records) {
+    inputs.push_back(as_span(r));
+  }
+
+  std::vector<decltype(compiled)::match_result> matched(inputs.size());
+  matches_many(compiled, inputs, matched, pool);
+
+  std::vector<std::vector<decltype(compiled)::find_result>> found(inputs.size());
+  find_many_documents(regex, inputs, found, pool);
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    ASSERT_EQ((bool)matched[i], (bool)regex.matches(inputs[i])) << "bulk matches agree with matches() on #" << i;
+    ASSERT_EQ(found[i].size(), 1) << "every record holds exactly one keyword";
+
+    auto const& range = found[i][0].range;
+    std::string const expected[] = {"for", "while", "return", "return"};
+    ASSERT_EQ(std::string(range.begin(), range.end()), expected[i % 4]);
+  }
+}
+
+TEST(state_machine, hot_swap) {
+  auto const machine_for = [](std::string word) {
+    Regex regex;
+    regex.match_sequence(word).exit_point().optimize();
+    return regex.compile();
+  };
+
+  MachineHandle handle(machine_for("v0"));
+  std::atomic<bool> done       = false;
+  std::atomic<size_t> failures = 0;
+
+  // more readers than there are reader slots, so some of them are counted in the overflow slot
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < 72; t++) {
+    readers.emplace_back([&] {
+      std::string versions[] = {"v0", "v1", "v2", "v3"};
+      while (!done) {
+        auto machine = handle.read();
+        auto nested  = handle.read();
+        size_t hits  = 0;
+        for (auto& v : versions) {
+          hits += (bool)machine->matches(as_span(v));
+          hits += (bool)nested->matches(as_span(v));
+        }
+        // every machine accepts exactly one of the versions
+        if (hits != 2) {
+          failures++;
+        }
+      }
+    });
+  }
+
+  for (size_t i = 1; i < 4; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    handle.publish(machine_for("v" + std::to_string(i)));
+  }
+  done = true;
+  for (auto& r : readers) {
+    r.join();
+  }
+
+  ASSERT_EQ(failures, 0);
+  std::string v3 = "v3";
+  ASSERT_TRUE(handle.read()->matches(as_span(v3))) << "the latest machine is published";
+}
+
+TEST(state_machine, incremental) {
+  auto const optimized = [](std::vector<std::string> words) {
+    Regex regex;
+    for (auto& w : words) {
+      regex.match_sequence(w).exit_point().root();
+    }
+    return regex.optimize();
+  };
+
+  Regex regex;
+  regex.insert_sequence("for").insert_sequence("foreach").insert_sequence("while").insert_sequence("return");
+  ASSERT_EQ(regex.compact().compile().size(), keywords().compile().size())
+      << "incremental insertion keeps the machine minimal";
+
+  regex.insert_sequence("forever").insert_sequence("whence");
+  ASSERT_TRUE(full_match(regex, "forever"));
+  ASSERT_TRUE(full_match(regex, "whence"));
+  ASSERT_TRUE(full_match(regex, "foreach")) << "existing sequences are preserved";
+  ASSERT_FALSE(full_match(regex, "fore"));
+
+  ASSERT_TRUE(regex.erase_sequence("foreach"));
+  ASSERT_FALSE(regex.erase_sequence("foreach")) << "a sequence can only be erased once";
+  ASSERT_FALSE(regex.erase_sequence("fore")) << "prefixes are not sequences";
+  ASSERT_FALSE(full_match(regex, "foreach"));
+  ASSERT_TRUE(full_match(regex, "for")) << "erasing a sequence keeps its prefixes";
+  ASSERT_TRUE(full_match(regex, "forever"));
+
+  ASSERT_TRUE(regex.erase_sequence("for"));
+  ASSERT_FALSE(full_match(regex, "for"));
+  ASSERT_TRUE(full_match(regex, "forever")) << "erasing a prefix keeps its extensions";
+  ASSERT_EQ(regex.compact().compile().size(), optimized({"forever", "while", "whence", "return"}).compile().size())
+      << "incremental removal keeps the machine minimal";
+
+  StateMachine<int, char> values;
+  values.insert_sequence("one", 1).insert_sequence("two", 2).insert_sequence("three", 3);
+  values.erase_sequence("two");
+
+  std::string one = "one", two = "two", three = "three";
+  ASSERT_EQ(*values.matches(as_span(three)).value(), 3);
+  ASSERT_EQ(*values.matches(as_span(one)).value(), 1);
+  ASSERT_FALSE(values.matches(as_span(two)).success());
+}
+
+TEST(state_machine, remove_value) {
+  using Lookup = StateMachine<int, char>;
+
+  Lookup lookup;
+  // clang-format off
+  lookup
+    .match_sequence("cat").exit_point(1).root()
+    .match_sequence("car").exit_point(2).root()
+    .match_sequence("cart").exit_point(1).root()
+    .match_sequence("dog").exit_point(3).root()
+    .optimize();
+  // clang-format on
+
+  ASSERT_GT(lookup.remove_value(1), 0) << "the exit points holding the value are removed";
+  ASSERT_EQ(lookup.remove_value(1), 0) << "values can only be removed once";
+
+  std::string cat = "cat", car = "car", cart = "cart", dog = "dog";
+  ASSERT_FALSE(lookup.matches(as_span(cat)).success());
+  ASSERT_FALSE(lookup.matches(as_span(cart)).success());
+  ASSERT_EQ(*lookup.matches(as_span(car)).value(), 2) << "other values are preserved";
+  ASSERT_EQ(*lookup.matches(as_span(dog)).value(), 3) << "other values are preserved";
+
+  Lookup expected;
+  expected.match_sequence("car").exit_point(2).root().match_sequence("dog").exit_point(3).root().optimize();
+  ASSERT_EQ(lookup.compact().compile().size(), expected.compile().size()) << "the machine is re-minimized";
+}
+
+TEST(state_machine, tiered) {
+  Regex regex;
+  regex.match_sequence("for").exit_point().root().match_sequence("foreach").exit_point().root();
+
+  TieredMachine<Regex> tiered(regex);
+  std::string input = "foreach", partial = "fore";
+  ASSERT_TRUE(tiered.matches(as_span(input))) << "lookups are served before compilation finishes";
+  ASSERT_FALSE(tiered.matches(as_span(partial)));
+
+  tiered.wait();
+  ASSERT_EQ(tiered.tier(), 1);
+  ASSERT_NE(tiered.compiled(), nullptr);
+  ASSERT_TRUE(tiered.matches(as_span(input))) << "the compiled tier matches the same language";
+  ASSERT_FALSE(tiered.matches(as_span(partial)));
+
+  auto found = tiered.find(as_span(input));
+  ASSERT_EQ(std::string(found.range.begin(), found.range.end()), "foreach");
+
+  auto body = std::make_shared<Regex>();
+  for (char c = 'a'; c <= 'z'; c++) {
+    body->match_sequence(std::string(1, c));
+  }
+  body->exit_point();
+  Regex calling;
+  calling.match_call(body).exit_point();
+  TieredMachine<Regex> uncompilable(calling);
+  uncompilable.wait();
+  ASSERT_EQ(uncompilable.tier(), 0) << "machines with call edges stay on tier 0";
+  std::string alphabet = "abcdefghijklmnopqrstuvwxyz";
+  ASSERT_TRUE(uncompilable.matches(as_span(alphabet)));
+
+  struct FailingRegex : Regex {
+    FailingRegex& optimize() {
+      throw std::runtime_error("optimization failed");
+    }
+  };
+  TieredMachine<FailingRegex> failing{FailingRegex()};
+  ASSERT_THROW(failing.wait(), std::runtime_error) << "a failed compilation is reported";
+  ASSERT_EQ(failing.tier(), 0);
+}
+
+TEST(state_machine, machine_cache) {
+  using Compiled = decltype(keywords().compile());
+
+  std::atomic<size_t> builds = 0;
+  auto const build_keywords  = [&] {
+    builds++;
+    return keywords().compile();
+  };
+
+  MachineCache<Compiled> cache(2);
+  auto first = cache.get("keywords", build_keywords);
+  ASSERT_EQ(cache.get("keywords", build_keywords), first) << "a key is only built once";
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; t++) {
+    threads.emplace_back([&] { cache.get("concurrent", build_keywords); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(builds, 2) << "concurrent requests share a single build";
+
+  cache.get("other", build_keywords);
+  ASSERT_EQ(cache.size(), 2);
+  ASSERT_EQ(cache.stats().evictions, 1);
+  ASSERT_NE(cache.get("keywords", build_keywords), first) << "the least recently used machine is evicted";
+
+  std::string input = "while";
+  ASSERT_TRUE(first->matches(as_span(input))) << "evicted machines stay alive while they are held";
+
+  auto const failing_build = []() -> Compiled { throw std::runtime_error("build failed"); };
+  ASSERT_THROW(cache.get("failing", failing_build), std::runtime_error);
+  ASSERT_NE(cache.get("failing", build_keywords), nullptr) << "a failed build is not cached";
+}
+
+TEST(state_machine, structural_hash) {
+  Regex reordered;
+  // clang-format off
+  reordered
+    .match_sequence("return").exit_point().root()
+    .match_sequence("while").exit_point().root()
+    .match_sequence("foreach").exit_point().root()
+    .match_sequence("for").exit_point().root()
+    .optimize();
+  // clang-format on
+
+  auto regex = keywords();
+  ASSERT_TRUE(regex == reordered) << "equality does not depend on construction order";
+  ASSERT_EQ(regex.structural_hash(), reordered.structural_hash());
+
+  std::string corpus = "return return return while";
+  std::vector<size_t> visits;
+  reordered.record_visits(as_span(corpus), visits);
+  reordered.renumber(visits);
+  ASSERT_TRUE(regex == reordered) << "equality does not depend on numbering";
+  ASSERT_EQ(regex.structural_hash(), reordered.structural_hash());
+
+  reordered.insert_sequence("do");
+  ASSERT_FALSE(regex == reordered);
+  ASSERT_NE(regex.structural_hash(), reordered.structural_hash());
+
+  StateMachine<int, char> one, two;
+  one.match_sequence("x").exit_point(1).optimize();
+  two.match_sequence("x").exit_point(2).optimize();
+  ASSERT_FALSE(one == two) << "values take part in equality";
+  ASSERT_NE(one.structural_hash(), two.structural_hash());
+
+  using Compiled = decltype(keywords().compile());
+  MachineCache<Compiled, StructuralHash> cache(4);
+  auto first = cache.get(regex.structural_hash(), [&] { return regex.compile(); });
+  ASSERT_EQ(cache.get(keywords().structural_hash(), [&] { return keywords().compile(); }), first)
+      << "equal machines deduplicate by their hash";
+}
+
+TEST(state_machine, copy_on_write) {
+  auto const base = keywords();
+
+  std::vector<Regex> variants(8, base);
+  for (size_t i = 0; i < variants.size(); i++) {
+    variants[i].insert_sequence("tenant" + std::to_string(i));
+  }
+
+  ASSERT_TRUE(base == keywords()) << "modifying a copy leaves the original untouched";
+  for (size_t i = 0; i < variants.size(); i++) {
+    std::string own = "tenant" + std::to_string(i), other = "tenant" + std::to_string((i + 1) % variants.size());
+    ASSERT_TRUE(variants[i].matches(as_span(own)));
+    ASSERT_FALSE(variants[i].matches(as_span(other))) << "copies diverge independently";
+    ASSERT_TRUE(full_match(variants[i], "foreach")) << "copies keep the shared structure";
+  }
+
+  auto clone = variants[0];
+  clone.insert_sequence("fork");
+  ASSERT_TRUE(full_match(clone, "fork")) << "copies rebuild their own incremental index";
+  ASSERT_TRUE(full_match(clone, "tenant0"));
+  ASSERT_FALSE(full_match(variants[0], "fork"));
+
+  auto moved = std::move(clone);
+  ASSERT_TRUE(full_match(moved, "fork")) << "moving a machine keeps its nodes";
+  clone = keywords();
+  ASSERT_TRUE(full_match(clone, "foreach")) << "a moved-from machine may be assigned to";
+}
+
+TEST(state_machine, match_cache) {
+  auto const compiled = keywords().compile();
+  MatchCache cache(compiled);
+
+  std::string hot[] = {"for", "while", "fore", "return"};
+  for (size_t i = 0; i < 4000; i++) {
+    auto& input = hot[i % 4];
+    ASSERT_EQ((bool)cache.matches(as_span(input)), (bool)compiled.matches(as_span(input)));
+  }
+  auto stats = cache.stats();
+  ASSERT_EQ(stats.lookups, 4000);
+  ASSERT_GE(stats.hits, 3990) << "repeated inputs are answered from the cache";
+
+  std::string long_input(100, 'a');
+  ASSERT_FALSE(cache.matches(as_span(long_input)));
+  ASSERT_EQ(cache.stats().bypassed, 1) << "long inputs are not cached";
+  ASSERT_FALSE(cache.matches(std::span<char>())) << "an empty input (with a null pointer) may be looked up";
+
+  // unique inputs drive the hit rate down, until the cache is bypassed
+  MatchCache cold(compiled);
+  for (size_t i = 0; i < 64 * 1024; i++) {
+    auto input = std::to_string(i);
+    ASSERT_FALSE(cold.matches(as_span(input)));
+  }
+  ASSERT_GT(cold.stats().bypassed, 32 * 1024) << "the cache is bypassed while its hit rate is low";
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}